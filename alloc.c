@@ -1,10 +1,14 @@
+#define _GNU_SOURCE
+
 #include "alloc.h"
 #include "bl.h"
-#include "brl.h"
 #include "gc.h"
 #include "mem.h"
+#include "pm.h"
+#include "stats.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,64 +19,290 @@
 #include <unistd.h>
 
 #define NEW_BLOCK_THRESHOLD 8
-#define INITIAL_ALLOCATOR_SIZE 128 * sizeof(int)
+// Blocks that have a mapping to themselves and are at least this large are
+// grown by remapping their pages rather than copying them
+#define REMAP_THRESHOLD (64ul << 10)
+#define INITIAL_ALLOCATOR_SIZE (256ul << 10)
 #define INITIAL_HEADER_BUFFER_CAPACITY 8
 #define NA NARSIRABAD_ALLOCATOR
+#define NC NARSIRABAD_COLLECTOR
 
 Allocator NARSIRABAD_ALLOCATOR;
 
-extern char __bss_start;
-extern char __data_start;
+extern Collector NARSIRABAD_COLLECTOR;
 
-uintptr_t end_of_bss;
-uintptr_t start_of_bss;
+extern __thread Mutator mutator;
 
-uintptr_t bottom_of_stack;
-uintptr_t top_of_stack;
+__thread ThreadCache thread_cache;
 
-// Internal functions
+// Flushes a thread's cache back into the heap when the thread exits
+pthread_key_t thread_cache_key;
 
-void print_headers() {
-    printf("Free Headers:\n");
-    for (int i = 0; i < NA.free_headers.len; i++) {
-        Block* header = BRL_idx(&NA.free_headers, i);
+// Internal functions
 
-        printf("\t{ ptr: %po; size: 0x%lx; offset: %d }\n", header->ptr,
-               header->size, header->offset);
+/*
+ * Returns a boolean indicating whether the block is available for use.
+ *
+ * `header` - Pointer to the header of the block.
+ */
+bool is_free(Block* header) { return header->flags & BLOCK_FREE; }
+
+void count_block(Block* header, bool add) {
+    size_t* bytes = &NA.bytes_used;
+    size_t* blocks = &NA.blocks_used;
+    if (is_free(header)) {
+        bytes = &NA.bytes_free;
+        blocks = &NA.blocks_free;
     }
 
-    if (NA.used_headers.len > 0)
-        printf("Used Headers:\n");
-    for (int i = 0; i < NA.used_headers.len; i++) {
-        Block* header = BRL_idx(&NA.used_headers, i);
+    if (add) {
+        *bytes += header->size;
+        *blocks += 1;
+    } else {
+        *bytes -= header->size;
+        *blocks -= 1;
+    }
 
-        printf("\t{ ptr: %po; size: 0x%lx; offset: %d }\n", header->ptr,
-               header->size, header->offset);
+    if (header->flags & BLOCK_LARGE) {
+        if (add) {
+            NA.bytes_large += header->size;
+            NA.blocks_large++;
+        } else {
+            NA.bytes_large -= header->size;
+            NA.blocks_large--;
+        }
     }
+}
+
+/*
+ * Rounds a requested size up to the granularity of the size classes.
+ */
+size_t round_size(size_t size) {
+    if (size == 0)
+        return ALIGNMENT;
 
-    puts("");
+    return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
 }
 
 /*
- * Returns a boolean indicating whether the block is available for use.
+ * Returns the size class of a block of `size` bytes.
  *
- * `header` - Pointer to the header of the block.
+ * `size` must already be rounded with `round_size`
+ */
+uint32_t bin_index(size_t size) {
+    if (size <= SMALL_BIN_MAX)
+        return size / ALIGNMENT - 1;
+
+    uint32_t log2 = 63 - __builtin_clzll(size);
+    uint32_t bin = SMALL_BIN_COUNT + log2 - SMALL_BIN_SHIFT;
+
+    return bin < BIN_COUNT ? bin : BIN_COUNT - 1;
+}
+
+/*
+ * Returns the address handed out to the user for a block, which is just past
+ * the block's tag.
+ *
+ * Blocks start on a multiple of `ALIGNMENT`, a block aligned any further
+ * starts that much later instead, see `take_aligned`.
+ */
+void* block_data(Block* header) {
+    return (uint8_t*)header->ptr + sizeof(BlockTag);
+}
+
+/*
+ * Writes the inline tag of a block that is about to be handed out, linking
+ * the memory back to its header.
+ *
+ * Returns the address handed out to the user
+ *
+ * `block_idx` - The index of the block in `NA.headers`
+ */
+void* tag_block(uint32_t block_idx) {
+    void* data = block_data(BL_idx(&NA.headers, block_idx));
+
+    BlockTag* tag = (BlockTag*)data - 1;
+    tag->idx = block_idx;
+    tag->magic = BLOCK_MAGIC;
+    tag->bin = bin_index(BL_idx(&NA.headers, block_idx)->size);
+    tag->cached = false;
+    tag->young = true;
+    tag->epoch = NC.epoch;
+    tag->atomic = false;
+    tag->layout = 0;
+    NA.in_use += BL_idx(&NA.headers, block_idx)->size;
+
+    // The block is about to be written to, only the tag still knows
+    tag->zeroed = (BL_idx(&NA.headers, block_idx)->flags & BLOCK_ZERO) != 0;
+    BL_idx(&NA.headers, block_idx)->flags &= ~BLOCK_ZERO;
+
+    PM_add_block(&NA.page_map, block_idx, BL_idx(&NA.headers, block_idx));
+
+    return data;
+}
+
+/*
+ * Finds the header of a block from the address that was handed out for it by
+ * reading the block's tag.
+ *
+ * Returns the index of the block in `NA.headers`, or `BLOCK_NONE` if `ptr`
+ * isn't the address of a used block
  */
-bool is_free(Block* header) { return BRL_find(&NA.free_headers, header) != -1; }
+uint32_t tagged_block(void* ptr) {
+    BlockTag* tag = (BlockTag*)ptr - 1;
+    if (tag->magic != BLOCK_MAGIC || tag->idx >= NA.headers.len)
+        return BLOCK_NONE;
+
+    Block* header = BL_idx(&NA.headers, tag->idx);
+    if (header->ptr == NULL || is_free(header) || block_data(header) != ptr)
+        return BLOCK_NONE;
+
+    return tag->idx;
+}
+
+/*
+ * Pushes a free block onto the front of the bin for its size class.
+ */
+void bin_insert(uint32_t block_idx) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+    uint32_t bin = bin_index(header->size);
+    uint32_t head = NA.bins[bin];
+
+    header->prev_free = BLOCK_NONE;
+    header->next_free = head;
+    if (head != BLOCK_NONE)
+        BL_idx(&NA.headers, head)->prev_free = block_idx;
+
+    NA.bins[bin] = block_idx;
+    NA.bin_map |= 1ull << bin;
+}
+
+/*
+ * Unlinks a free block from the bin it sits in.
+ */
+void bin_remove(uint32_t block_idx) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+    uint32_t bin = bin_index(header->size);
+
+    if (header->prev_free != BLOCK_NONE)
+        BL_idx(&NA.headers, header->prev_free)->next_free = header->next_free;
+    else
+        NA.bins[bin] = header->next_free;
+
+    if (header->next_free != BLOCK_NONE)
+        BL_idx(&NA.headers, header->next_free)->prev_free = header->prev_free;
+
+    if (NA.bins[bin] == BLOCK_NONE)
+        NA.bin_map &= ~(1ull << bin);
+
+    header->next_free = BLOCK_NONE;
+    header->prev_free = BLOCK_NONE;
+}
+
+/*
+ * Finds a free block of at least `size` bytes, without removing it from its
+ * bin.
+ *
+ * Small sizes are served by the head of their exact bin. Large sizes take the
+ * best fit in their own bin, since a power-of-two class also holds blocks
+ * smaller than the request. If that fails, the head of the next non-empty
+ * bin is taken, every block in it is large enough.
+ *
+ * Returns the index of the block in `NA.headers`, or `BLOCK_NONE`
+ *
+ * `size` - The size of the allocation, rounded with `round_size`
+ */
+uint32_t find_free_block(size_t size) {
+    uint32_t bin = bin_index(size);
+
+    if (bin < SMALL_BIN_COUNT) {
+        if (NA.bins[bin] != BLOCK_NONE)
+            return NA.bins[bin];
+    } else {
+        uint32_t best = BLOCK_NONE;
+        size_t best_size = SIZE_MAX;
+
+        for (uint32_t idx = NA.bins[bin]; idx != BLOCK_NONE;) {
+            Block* header = BL_idx(&NA.headers, idx);
+            if (header->size >= size && header->size < best_size) {
+                best = idx;
+                best_size = header->size;
+
+                if (best_size == size)
+                    break;
+            }
+
+            idx = header->next_free;
+        }
+
+        if (best != BLOCK_NONE)
+            return best;
+    }
+
+    if (bin + 1 == BIN_COUNT)
+        return BLOCK_NONE;
+
+    uint64_t larger = NA.bin_map & ~((2ull << bin) - 1);
+    if (larger == 0)
+        return BLOCK_NONE;
+
+    return NA.bins[__builtin_ctzll(larger)];
+}
 
 /*
- * Creates a new free header owning `size` bytes starting at `ptr`.
+ * Creates a new free header owning `size` bytes starting at `ptr`, and files it
+ * in the matching bin.
  *
  * It is the responsibility of the caller to ensure that there are no other
- * blocks in `NA.headers` that claim to own an overlapping chunk of memory.
+ * blocks in `NA.headers` that claim to own an overlapping chunk of memory, and
+ * to link the new block to its physical neighbours.
  *
  * WARNING
  * This function has the potential to reallocate the `NA.headers` blocklist.
  */
-void new_free_header(void* ptr, size_t size) {
-    // These will automatically expand the lists
-    size_t header_idx = BL_new_header(&NA.headers, size, ptr);
-    BRL_push(&NA.free_headers, header_idx);
+uint32_t new_free_header(void* ptr, size_t size) {
+    // This will automatically expand the list
+    uint32_t header_idx = BL_new_header(&NA.headers, size, ptr);
+    BL_idx(&NA.headers, header_idx)->flags |= BLOCK_FREE;
+    BL_idx(&NA.headers, header_idx)->freed_at = NA.purge_clock;
+    count_block(BL_idx(&NA.headers, header_idx), true);
+    bin_insert(header_idx);
+
+    return header_idx;
+}
+
+/*
+ * Links the block at `second_idx` in right after the block at `first_idx` in
+ * physical order.
+ */
+void link_after(uint32_t first_idx, uint32_t second_idx) {
+    Block* first = BL_idx(&NA.headers, first_idx);
+    Block* second = BL_idx(&NA.headers, second_idx);
+
+    second->prev_phys = first_idx;
+    second->next_phys = first->next_phys;
+
+    if (first->next_phys != BLOCK_NONE)
+        BL_idx(&NA.headers, first->next_phys)->prev_phys = second_idx;
+
+    first->next_phys = second_idx;
+}
+
+/*
+ * Links the block at `first_idx` in right before the block at `second_idx` in
+ * physical order.
+ */
+void link_before(uint32_t second_idx, uint32_t first_idx) {
+    Block* first = BL_idx(&NA.headers, first_idx);
+    Block* second = BL_idx(&NA.headers, second_idx);
+
+    first->next_phys = second_idx;
+    first->prev_phys = second->prev_phys;
+
+    if (second->prev_phys != BLOCK_NONE)
+        BL_idx(&NA.headers, second->prev_phys)->next_phys = first_idx;
+
+    second->prev_phys = first_idx;
 }
 
 /*
@@ -83,235 +313,1188 @@ void new_free_header(void* ptr, size_t size) {
  *
  * WARNING
  * This function has the potential to reallocate the `NA.headers` list,
- * potentially making every pointer into that list invalid. If this function
- * does reallocate, consider re-initializing all `BlockRefList` objects.
+ * potentially making every pointer into that list invalid.
  *
- * `block_idx` - The index of the header in `NA.used_blocks` that you wish to
+ * `block_idx` - The index of the header in `NA.headers` that you wish to
  * split
- * `new_size` - The new size of the allocation, does not include the
- * offset If you wish to include the offset, it should be set in
- * `header->offset` before calling this function.
+ * `new_size` - The new size of the allocation, including its tag
  */
-Block* try_split_block(uint32_t block_idx, uint32_t new_size) {
-    Block* header = BRL_idx(&NA.used_headers, block_idx);
+Block* try_split_block(uint32_t block_idx, size_t new_size) {
+    Block* header = BL_idx(&NA.headers, block_idx);
     // We have to save the pointer
     // because `header` will become invalid if we expand the block list
     void* ptr = header->ptr;
+    uint8_t zero = header->flags & BLOCK_ZERO;
 
-    size_t remaining = header->size - new_size - header->offset;
+    size_t remaining = header->size - new_size;
     if (remaining <= NEW_BLOCK_THRESHOLD) {
         return header;
     }
 
     // Shrink old header
+    count_block(header, false);
     header->size = new_size;
+    count_block(header, true);
     // Create new header
-    new_free_header((void*)(ptr + new_size), remaining);
+    uint32_t remaining_idx =
+        new_free_header((uint8_t*)ptr + new_size, remaining);
+    BL_idx(&NA.headers, remaining_idx)->flags |= zero;
+    link_after(block_idx, remaining_idx);
 
-    return BRL_idx(&NA.used_headers, block_idx);
+    return BL_idx(&NA.headers, block_idx);
 }
 
 /*
- * Merges two headers that point to adjacent data into one header of combined
- * size.
+ * Merges two free headers that point to adjacent data into one header of
+ * combined size.
  *
- * `first_idx` - The index of the first block (by pointer) in the
- * `NA.free_headers` list. `second` - The index of the second block (by pointer)
- * in the `NA.free_headers` list.
+ * `first_idx` - The index of the first block (by pointer) in `NA.headers`
+ * `second_idx` - The index of the second block (by pointer) in `NA.headers`
  */
-void merge_blocks(uint16_t first_idx, uint16_t second_idx) {
-    Block* first = BRL_idx(&NA.free_headers, first_idx);
-    Block* second = BRL_idx(&NA.free_headers, second_idx);
+void merge_blocks(uint32_t first_idx, uint32_t second_idx) {
+    bin_remove(first_idx);
+    bin_remove(second_idx);
+
+    Block* first = BL_idx(&NA.headers, first_idx);
+    Block* second = BL_idx(&NA.headers, second_idx);
+    count_block(first, false);
+    count_block(second, false);
 
     // Expand the first block
-    first->size += second->size + second->offset;
+    first->size += second->size;
+    count_block(first, true);
+    if (!(second->flags & BLOCK_ZERO))
+        first->flags &= ~BLOCK_ZERO;
+    if (second->freed_at > first->freed_at)
+        first->freed_at = second->freed_at;
+
+    // Unlink the second block
+    first->next_phys = second->next_phys;
+    if (second->next_phys != BLOCK_NONE)
+        BL_idx(&NA.headers, second->next_phys)->prev_phys = first_idx;
 
     // Clear the old block
-    BL_find_remove(&NA.headers, second);
-    BRL_remove(&NA.free_headers, second_idx);
+    BL_drop_header(&NA.headers, second_idx);
+
+    // The combined block most likely belongs to a different size class
+    bin_insert(first_idx);
+}
+
+/*
+ * Whether a neighbouring block can be merged into, the nursery is free but
+ * sits in no bin.
+ */
+bool is_mergeable(uint32_t block_idx) {
+    return block_idx != BLOCK_NONE && block_idx != NA.nursery &&
+           is_free(BL_idx(&NA.headers, block_idx));
 }
 
 /*
- * Attempts to merge every block past `header_idx` with other memory adjacent
- * free blocks.
+ * Attempts to merge a free block with the free blocks directly before and
+ * after it in memory.
+ *
+ * Since every free block is merged as soon as it's freed, a free block can
+ * only ever have one free neighbour on each side.
  *
- * To try merging every block: `try_merge_block(0)`.
+ * Returns the index of the merged block in `NA.headers`, which is the index of
+ * the lowest (by pointer) of the merged blocks.
  *
- * `header_idx` - The index of the  block in `NA.free_headers` that you wish to
+ * `header_idx` - The index of the free block in `NA.headers` that you wish to
  * attempt to merge.
  */
-uint16_t try_merge_block(uint16_t header_idx) {
-    Block header = *BRL_idx(&NA.free_headers, header_idx);
-    uintptr_t start = (uintptr_t)header.ptr;
-    uintptr_t end = start + header.size;
+uint32_t try_merge_block(uint32_t header_idx) {
+    Block* header = BL_idx(&NA.headers, header_idx);
+    uint32_t next_idx = header->next_phys;
+    uint32_t prev_idx = header->prev_phys;
+
+    if (is_mergeable(next_idx))
+        merge_blocks(header_idx, next_idx);
+
+    if (is_mergeable(prev_idx)) {
+        merge_blocks(prev_idx, header_idx);
+        header_idx = prev_idx;
+    }
+
+    return header_idx;
+}
+
+void use_block(uint32_t block_idx) {
+    Block* block = BL_idx(&NA.headers, block_idx);
+    if (!is_free(block))
+        return;
+
+    bin_remove(block_idx);
+    count_block(block, false);
+    block->flags &= ~BLOCK_FREE;
+    count_block(block, true);
+}
+
+/*
+ * Hands out the first `size` bytes of a free block as a new used block.
+ *
+ * The free block keeps what is left, which saves relinking it anywhere but in
+ * its bin.
+ *
+ * Returns the index of the new used block in `NA.headers`
+ *
+ * WARNING
+ * This function has the potential to reallocate the `NA.headers` list.
+ *
+ * `block_idx` - The index of the free block in `NA.headers`, which must be
+ * larger than `size`
+ */
+uint32_t carve_block(uint32_t block_idx, size_t size) {
+    bin_remove(block_idx);
+
+    Block* block = BL_idx(&NA.headers, block_idx);
+    void* ptr = block->ptr;
+    uint8_t zero = block->flags & BLOCK_ZERO;
+
+    count_block(block, false);
+    block->ptr = (uint8_t*)ptr + size;
+    block->size -= size;
+    count_block(block, true);
+    bin_insert(block_idx);
+
+    uint32_t used_idx = BL_new_header(&NA.headers, size, ptr);
+    BL_idx(&NA.headers, used_idx)->flags = zero;
+    count_block(BL_idx(&NA.headers, used_idx), true);
+
+    // Goes in between the free block and whatever came before it
+    link_before(block_idx, used_idx);
+
+    return used_idx;
+}
+
+/*
+ * Takes a block that is no longer used off `NA.in_use`, which may have drifted
+ * below its size since the last sweep.
+ */
+void count_unused(size_t size) {
+    NA.in_use = NA.in_use > size ? NA.in_use - size : 0;
+}
+
+void free_block(uint32_t block_idx) {
+    Block* block = BL_idx(&NA.headers, block_idx);
+    if (is_free(block))
+        return;
+
+    count_unused(block->size);
+
+    PM_remove_block(&NA.page_map, block);
+    // A stale pointer to the block must not pass for a used block any more
+    ((BlockTag*)block_data(block) - 1)->magic = 0;
+
+    count_block(block, false);
+    block->flags |= BLOCK_FREE;
+    count_block(block, true);
+    block->freed_at = NA.purge_clock;
+    bin_insert(block_idx);
+}
+
+// Purging
+
+/*
+ * Hands the whole pages inside a free block back to the kernel. What is left
+ * on either side of them is zeroed, so that the whole block is known to be.
+ *
+ * Returns how many bytes were purged
+ */
+size_t purge_block(Block* block) {
+    size_t page_size = getpagesize();
+    uintptr_t start = (uintptr_t)block->ptr;
+    uintptr_t end = start + block->size;
+    uintptr_t first = (start + page_size - 1) & ~(page_size - 1);
+    uintptr_t last = end & ~(page_size - 1);
 
-    for (int i = 0; i < NA.free_headers.len; i++) {
-        Block* other_header = BRL_idx(&NA.free_headers, i);
+    if (last <= first || last - first < PURGE_MIN_SIZE)
+        return 0;
 
-        uintptr_t other_start = (uintptr_t)other_header->ptr;
-        uintptr_t other_end =
-            other_start + other_header->size + other_header->offset;
+    if (madvise((void*)first, last - first, MADV_DONTNEED) == -1)
+        return 0;
 
-        if (other_start == end) {
-            merge_blocks(header_idx, i);
+    memset((void*)start, 0, first - start);
+    memset((void*)last, 0, end - last);
+    block->flags |= BLOCK_ZERO;
 
-            if (header_idx > i--)
-                header_idx--;
+    return last - first;
+}
 
-        } else if (other_end == start) {
-            merge_blocks(i, header_idx);
+void purge_blocks(uint64_t freed_before) {
+    // Writes to the heap are being tracked, and free blocks don't need them
+    if (NC.cycle_active)
+        return;
 
-            if (header_idx > i--)
-                header_idx--;
+    size_t purged = 0;
+    uint64_t blocks = 0;
+    for (uint32_t i = 0; i < NA.headers.len; i++) {
+        Block* header = BL_idx(&NA.headers, i);
+        if (header->ptr == NULL || !is_free(header) || i == NA.nursery)
+            continue;
+
+        // Either never touched or purged already
+        if (header->flags & BLOCK_ZERO || header->freed_at > freed_before)
+            continue;
+
+        size_t bytes = purge_block(header);
+        if (bytes > 0) {
+            purged += bytes;
+            blocks++;
         }
     }
 
-    // If we're not at the end of the list, try to merge the next block
-    if (header_idx + 1 < NA.free_headers.len) {
-        return try_merge_block(header_idx + 1);
-    } else {
-        return header_idx;
+    NA.purged += purged;
+    NA.purges += blocks;
+    if (blocks > 0)
+        NAR_TRACE(NAR_EVENT_PURGE, purged, blocks);
+}
+
+/*
+ * Moves `NA.purge_clock` along, and purges the blocks that have been idle for
+ * `NA.purge_decay` if it's been long enough since the last time.
+ *
+ * Called with the lock held on the way through the slow paths
+ */
+void purge_tick() {
+    uint64_t now = now_ns();
+    NA.purge_clock = now;
+
+    if (NA.purge_decay == UINT64_MAX ||
+        now - NA.last_purge < NA.purge_decay / PURGE_CHECKS)
+        return;
+
+    NA.last_purge = now;
+    if (now >= NA.purge_decay)
+        purge_blocks(now - NA.purge_decay);
+}
+
+/*
+ * Maps `size` bytes for the heap right after what was mapped last, until the
+ * reserved range runs out.
+ */
+void* heap_map(size_t size) {
+    if (NA.reserved != NULL && HEAP_RESERVE - NA.committed >= size) {
+        void* ptr = map_fixed(NA.reserved + NA.committed, size);
+        if (ptr != MAP_FAILED) {
+            NA.committed += size;
+            if (NA.huge_pages)
+                map_huge(ptr, size, true);
+
+            return ptr;
+        }
     }
+
+    return map_new(size);
 }
 
-/// Calculates the offset necessary to align `header->ptr` to
-/// `alignof(max_align_t)`. Puts the calculated value in `header->offset`
-///
-///
-/// This is the same alignment that `malloc` ensures:
-/// http://kernel.org/doc/man-pages/online/pages/man3/malloc.3.html
+/// Allocates a new block of at least `size`, rounded up to whole pages, and
+/// no smaller than `NA.growth`
+/// Expands the header buffer if necessary
 ///
-/// `header` - The header representing the allocation to be aligned
-void align_block(Block* header) {
-    uint8_t diff = (uintptr_t)header->ptr % 8;
-    if (diff != 0) {
-        header->offset = 8 - diff;
+/// Returns the index of the new (used) block in `NA.headers`, or `BLOCK_NONE`
+/// on failure
+uint32_t expand_memory(size_t size) {
+    size_t page_size = getpagesize();
+    size = (size + page_size - 1) & ~(page_size - 1);
+    if (size < NA.growth)
+        size = NA.growth;
+
+    void* ptr = heap_map(size);
+    if (ptr == MAP_FAILED) {
+        return BLOCK_NONE;
     }
 
-    header->offset = 0;
+    PM_map(&NA.page_map, ptr, size);
+    track_mapping(ptr, size);
+
+    __atomic_fetch_add(&NA.mapped, size, __ATOMIC_RELAXED);
+    NAR_TRACE(NAR_EVENT_EXPAND, ptr, size);
+
+    if (NA.growth < HEAP_GROWTH_MAX)
+        NA.growth *= 2;
+
+    uint32_t idx = BL_new_header(&NA.headers, size, ptr);
+    BL_idx(&NA.headers, idx)->flags = BLOCK_ZERO;
+    count_block(BL_idx(&NA.headers, idx), true);
+
+    return idx;
 }
 
-// TODO
-// Maybe realign here
-void use_block(Block* block) {
-    bool was_free = BRL_find_remove(&NA.free_headers, block);
-    if (!was_free)
-        return;
+// Large objects
+
+/*
+ * Maps a used block of `needed` bytes on its own, collecting first if the
+ * block takes the heap in use to its goal, see Pacing in `gc.h`.
+ *
+ * Returns the index of the block in `NA.headers`, or `BLOCK_NONE`
+ *
+ * WARNING
+ * This function has the potential to reallocate the `NA.headers` list.
+ */
+uint32_t map_large(size_t needed) {
+    size_t page_size = getpagesize();
+    size_t size = (needed + page_size - 1) & ~(page_size - 1);
+
+    if (!NC.disabled && collection_due(size))
+        collect_paced();
+
+    void* ptr = map_new(size);
+    if (ptr == MAP_FAILED)
+        return BLOCK_NONE;
+
+    PM_map(&NA.page_map, ptr, size);
+    track_mapping(ptr, size);
+
+    __atomic_fetch_add(&NA.mapped, size, __ATOMIC_RELAXED);
+    NAR_TRACE(NAR_EVENT_EXPAND, ptr, size);
+
+    uint32_t idx = BL_new_header(&NA.headers, size, ptr);
+    Block* header = BL_idx(&NA.headers, idx);
+    header->flags = BLOCK_LARGE | BLOCK_ZERO;
+    count_block(header, true);
+
+    header->next_free = NA.large;
+    if (NA.large != BLOCK_NONE)
+        BL_idx(&NA.headers, NA.large)->prev_free = idx;
+    NA.large = idx;
+
+    return idx;
+}
+
+void free_large(uint32_t block_idx) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+
+    if (header->prev_free != BLOCK_NONE)
+        BL_idx(&NA.headers, header->prev_free)->next_free = header->next_free;
+    else
+        NA.large = header->next_free;
 
-    BRL_push_block(&NA.used_headers, block);
+    if (header->next_free != BLOCK_NONE)
+        BL_idx(&NA.headers, header->next_free)->prev_free = header->prev_free;
+
+    count_unused(header->size);
+    PM_remove_block(&NA.page_map, header);
+    PM_unmap(&NA.page_map, header->ptr, header->size);
+    munmap(header->ptr, header->size);
+    __atomic_fetch_sub(&NA.mapped, header->size, __ATOMIC_RELAXED);
+
+    count_block(header, false);
+    BL_drop_header(&NA.headers, block_idx);
 }
 
-void free_block(Block* block) {
-    bool was_used = BRL_find_remove(&NA.used_headers, block);
-    if (!was_used)
+/*
+ * Shrinks a large block to the whole pages `needed` bytes take, unmapping the
+ * rest. The caller updates the page map.
+ */
+void shrink_large(uint32_t block_idx, size_t needed) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+    size_t page_size = getpagesize();
+    size_t size = (needed + page_size - 1) & ~(page_size - 1);
+    if (size >= header->size)
         return;
 
-    size_t idx = BL_find(&NA.headers, block);
-    BRL_push_block(&NA.free_headers, block);
+    uint8_t* end = (uint8_t*)header->ptr + size;
+    PM_unmap(&NA.page_map, end, header->size - size);
+    munmap(end, header->size - size);
+    __atomic_fetch_sub(&NA.mapped, header->size - size, __ATOMIC_RELAXED);
 
-    block->size += block->offset;
-    block->offset = 0;
+    count_block(header, false);
+    header->size = size;
+    count_block(header, true);
 }
 
-/// Allocates a new block of `size`
-/// Expands the header buffer if necessary
-///
-/// Returns the success value of the new allocation
-/// `true` for success, `false` for failure
-bool expand_memory(uint32_t size) {
-    void* ptr = map_new(size);
-    if (ptr == NULL) {
-        return false;
+/*
+ * Bumps a used block of `needed` bytes off the front of the nursery.
+ *
+ * Returns the index of the block in `NA.headers`, or `BLOCK_NONE` once the
+ * nursery has run out
+ *
+ * WARNING
+ * This function has the potential to reallocate the `NA.headers` list.
+ */
+uint32_t nursery_take(size_t needed) {
+    if (NA.nursery == BLOCK_NONE)
+        return BLOCK_NONE;
+
+    Block* nursery = BL_idx(&NA.headers, NA.nursery);
+    // Never hand out all of it, the nursery has to stay a block of its own
+    if (nursery->size < needed + ALIGNMENT)
+        return BLOCK_NONE;
+
+    void* ptr = nursery->ptr;
+    uint8_t zero = nursery->flags & BLOCK_ZERO;
+    count_block(nursery, false);
+    nursery->ptr = (uint8_t*)ptr + needed;
+    nursery->size -= needed;
+    count_block(nursery, true);
+
+    uint32_t used_idx = BL_new_header(&NA.headers, needed, ptr);
+    BL_idx(&NA.headers, used_idx)->flags = zero;
+    count_block(BL_idx(&NA.headers, used_idx), true);
+    link_before(NA.nursery, used_idx);
+
+    return used_idx;
+}
+
+/*
+ * Hands what is left of the nursery back to the bins, and takes a new one of
+ * `NURSERY_SIZE` bytes, from the bins if possible.
+ *
+ * `expand` - Whether to map more memory when no free block is large enough
+ *
+ * Returns whether there is a new nursery
+ */
+bool renew_nursery(bool expand) {
+    if (NA.nursery != BLOCK_NONE) {
+        uint32_t old_idx = NA.nursery;
+        NA.nursery = BLOCK_NONE;
+
+        bin_insert(old_idx);
+        try_merge_block(old_idx);
     }
 
-    size_t idx = BL_new_header(&NA.headers, size, ptr);
-    BRL_push(&NA.used_headers, idx);
+    uint32_t idx = find_free_block(NURSERY_SIZE);
+    if (idx != BLOCK_NONE) {
+        bin_remove(idx);
+        try_split_block(idx, NURSERY_SIZE);
+    } else {
+        if (!expand)
+            return false;
+
+        idx = expand_memory(NURSERY_SIZE);
+        if (idx == BLOCK_NONE)
+            return false;
 
+        count_block(BL_idx(&NA.headers, idx), false);
+        BL_idx(&NA.headers, idx)->flags |= BLOCK_FREE;
+        count_block(BL_idx(&NA.headers, idx), true);
+        try_split_block(idx, NURSERY_SIZE);
+    }
+
+    NA.nursery = idx;
     return true;
 }
 
+/*
+ * Takes a used block of `needed` bytes from the front of the free block
+ * `block_idx`, or all of it if too little would be left.
+ *
+ * Returns the index of the used block in `NA.headers`
+ *
+ * WARNING
+ * This function has the potential to reallocate the `NA.headers` list.
+ */
+uint32_t take_from(uint32_t block_idx, size_t needed) {
+    // Splitting off the front of the block leaves the free index untouched
+    if (BL_idx(&NA.headers, block_idx)->size - needed > NEW_BLOCK_THRESHOLD)
+        return carve_block(block_idx, needed);
+
+    use_block(block_idx);
+    return block_idx;
+}
+
+/*
+ * Takes a used block of `needed` bytes out of the free block `block_idx`,
+ * starting where its data ends up aligned to `alignment`. The gap in front
+ * of it stays free.
+ *
+ * Returns the index of the used block in `NA.headers`
+ *
+ * WARNING
+ * This function has the potential to reallocate the `NA.headers` list.
+ *
+ * `block_idx` - The index of a free block of at least
+ * `needed + alignment - ALIGNMENT` bytes
+ */
+uint32_t take_aligned(uint32_t block_idx, size_t needed, size_t alignment) {
+    uintptr_t start = (uintptr_t)BL_idx(&NA.headers, block_idx)->ptr;
+    uintptr_t data =
+        (start + sizeof(BlockTag) + alignment - 1) & ~(alignment - 1);
+    size_t gap = data - sizeof(BlockTag) - start;
+
+    if (gap > 0) {
+        uint32_t front_idx = carve_block(block_idx, gap);
+        count_block(BL_idx(&NA.headers, front_idx), false);
+        BL_idx(&NA.headers, front_idx)->flags |= BLOCK_FREE;
+        count_block(BL_idx(&NA.headers, front_idx), true);
+        bin_insert(front_idx);
+    }
+
+    return take_from(block_idx, needed);
+}
+
+/// Takes a used block of `needed` bytes out of the free blocks, without
+/// tagging or zeroing it
+///
+/// In generational mode, blocks that fit come from the nursery alone, so that
+/// running out of it is what triggers a minor collection. Blocks aligned to
+/// more than `ALIGNMENT` always come from the bins
+///
+/// Returns the index of the block in `NA.headers`, or `BLOCK_NONE`
+uint32_t take_block(size_t needed, size_t alignment) {
+    if (alignment > ALIGNMENT) {
+        uint32_t idx = find_free_block(needed + alignment - ALIGNMENT);
+        if (idx == BLOCK_NONE)
+            return BLOCK_NONE;
+
+        return take_aligned(idx, needed, alignment);
+    }
+
+    if (NA.generational && needed <= NURSERY_MAX_OBJECT)
+        return nursery_take(needed);
+
+    uint32_t idx = find_free_block(needed);
+    if (idx == BLOCK_NONE)
+        return BLOCK_NONE;
+
+    return take_from(idx, needed);
+}
+
+/*
+ * Zeroes the `data_size` bytes of data of a block that was just taken from the
+ * heap, unless they are known to be zero already.
+ *
+ * `keep` - How many bytes at the start the caller overwrites itself
+ */
+void clear_data(void* data, size_t data_size, size_t keep) {
+    BlockTag* tag = (BlockTag*)data - 1;
+    if (!tag->zeroed)
+        memset((uint8_t*)data + keep, 0, data_size - keep);
+
+    tag->zeroed = false;
+}
+
 /// Attempts to perform an allocation
 /// If it fails, it will not garbage collect nor alloate more memory
-void* try_allocate(uint32_t size) {
-    printf("Trying to allocate: %d\n", size);
-    print_headers();
-    for (int i = 0; i < NA.free_headers.len; i++) {
-        Block* header = BRL_idx(&NA.free_headers, i);
+///
+/// `zero` - Whether the first `size` bytes have to be zeroed, the rest of the
+/// block always is
+void* try_allocate(uint32_t size, size_t alignment, bool zero) {
+    size_t needed = round_size(size) + sizeof(BlockTag);
+    uint32_t idx = take_block(needed, alignment);
+    if (idx == BLOCK_NONE)
+        return NULL;
 
-        if (header->size < size)
-            continue;
+    void* data = tag_block(idx);
+    clear_data(data, BL_idx(&NA.headers, idx)->size - sizeof(BlockTag),
+               zero ? 0 : size);
 
-        align_block(header);
+    return data;
+}
 
-        use_block(header);
-        // We have to assign here, because our pointer could become invalid if
-        // `NA.headers` is reallocated
-        //
-        // Additionally, we can't use `i`, since that is the old idx in
-        // `NA.free_headers` The block is now in `NA.used_headers`
-        header = try_split_block(NA.used_headers.len - 1, size);
-        print_headers();
+/*
+ * Bumps one of the calling thread's counters, which `nar_stats` may be reading
+ * from another thread.
+ */
+void count_event(uint64_t* counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
 
-        memset(header->ptr, 0, header->size);
+/*
+ * Counts a block going into the calling thread's cache, or coming out of it.
+ * Cached blocks are exactly the size of their class, so this needs no lock to
+ * read their headers.
+ */
+void count_cached(BlockTag* tag, bool cached) {
+    size_t size = (tag->bin + 1) * ALIGNMENT;
+    if (cached) {
+        __atomic_store_n(&mutator.bytes_cached, mutator.bytes_cached + size,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&mutator.blocks_cached, mutator.blocks_cached + 1,
+                         __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&mutator.bytes_cached, mutator.bytes_cached - size,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&mutator.blocks_cached, mutator.blocks_cached - 1,
+                         __ATOMIC_RELAXED);
+    }
+}
 
-        return (uintptr_t*)header->ptr + header->offset;
+// Thread caches
+
+/*
+ * Moves up to `TCACHE_BATCH` blocks of a small size class, and no more than
+ * about `TCACHE_REFILL_BYTES`, from the heap into the calling thread's cache,
+ * under a single acquisition of the lock.
+ *
+ * This never collects or expands the heap, if there are no free blocks left
+ * the caller falls back on `allocate`'s slow path.
+ *
+ * `bin` - The size class to refill
+ */
+void cache_refill(uint32_t bin) {
+    size_t needed = (bin + 1) * ALIGNMENT;
+
+    size_t count = TCACHE_REFILL_BYTES / needed;
+    if (count > TCACHE_BATCH)
+        count = TCACHE_BATCH;
+
+    pthread_mutex_lock(&NA.lock);
+
+    // Refills are the most common trip through the lock, so they do most of
+    // the incremental marking. Finishing the cycle needs the top of our stack,
+    // so once marking is done the slow path is left to do it
+    if (NC.cycle_active && mark_slice()) {
+        pthread_mutex_unlock(&NA.lock);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t idx = take_block(needed, ALIGNMENT);
+        if (idx == BLOCK_NONE)
+            break;
+
+        void* data = tag_block(idx);
+        ((BlockTag*)data - 1)->cached = true;
+        count_cached((BlockTag*)data - 1, true);
+
+        *(void**)data = thread_cache.heads[bin];
+        thread_cache.heads[bin] = data;
+        thread_cache.counts[bin]++;
     }
+    pthread_mutex_unlock(&NA.lock);
+}
+
+/*
+ * Moves up to `count` blocks of a size class from the calling thread's cache
+ * back into the heap, under a single acquisition of the lock.
+ */
+void cache_flush(uint32_t bin, uint32_t count) {
+    pthread_mutex_lock(&NA.lock);
+    purge_tick();
+    for (uint32_t i = 0; i < count && thread_cache.heads[bin] != NULL; i++) {
+        void* data = thread_cache.heads[bin];
+        thread_cache.heads[bin] = *(void**)data;
+        thread_cache.counts[bin]--;
+
+        BlockTag* tag = (BlockTag*)data - 1;
+        tag->cached = false;
+        count_cached(tag, false);
+
+        free_block(tag->idx);
+        try_merge_block(tag->idx);
+    }
+    pthread_mutex_unlock(&NA.lock);
+}
+
+/*
+ * Takes a block of a small size class from the calling thread's cache,
+ * refilling the cache if it's empty.
+ *
+ * Returns the memory of the block, which is not zeroed, or `NULL` if the heap
+ * has no blocks to refill the cache with
+ */
+void* cache_pop(uint32_t bin) {
+    if (thread_cache.heads[bin] == NULL)
+        cache_refill(bin);
+
+    void* data = thread_cache.heads[bin];
+    if (data == NULL)
+        return NULL;
+
+    thread_cache.heads[bin] = *(void**)data;
+    thread_cache.counts[bin]--;
+    // The link was the only thing written to a block that is still zero
+    *(void**)data = NULL;
+    ((BlockTag*)data - 1)->cached = false;
+    count_cached((BlockTag*)data - 1, false);
+    ((BlockTag*)data - 1)->young = true;
+    ((BlockTag*)data - 1)->epoch = NC.epoch;
+    ((BlockTag*)data - 1)->atomic = false;
+    ((BlockTag*)data - 1)->layout = 0;
+
+    return data;
+}
+
+/*
+ * Puts a used block of a small size class into the calling thread's cache,
+ * flushing a batch to the heap first if the cache is full.
+ */
+void cache_push(uint32_t bin, void* data) {
+    if (thread_cache.counts[bin] >= TCACHE_MAX)
+        cache_flush(bin, TCACHE_BATCH);
+
+    ((BlockTag*)data - 1)->cached = true;
+    count_cached((BlockTag*)data - 1, true);
+
+    *(void**)data = thread_cache.heads[bin];
+    thread_cache.heads[bin] = data;
+    thread_cache.counts[bin]++;
+}
+
+/*
+ * Runs when a thread that used the heap exits: returns its cache to the heap
+ * and stops the collector from scanning its stack.
+ */
+void destroy_thread(void* cache) {
+    for (uint32_t bin = 0; bin < SMALL_BIN_COUNT; bin++)
+        cache_flush(bin, TCACHE_MAX);
+
+    unregister_mutator();
+    thread_cache.initialized = false;
+    thread_cache.exited = true;
+}
+
+/*
+ * Sets up the calling thread the first time it uses the heap: registers it
+ * with the collector and makes sure its cache is flushed when it exits.
+ */
+void init_thread() {
+    // Its `Mutator` goes away with it, so a thread that is exiting must never
+    // register again
+    if (thread_cache.exited)
+        return;
+
+    thread_cache.initialized = true;
+    register_mutator();
+
+    pthread_setspecific(thread_cache_key, &thread_cache);
+}
+
+// Forking
+//
+// The child only gets the thread that forked, so the lock is held across the
+// fork to keep the heap consistent, and everything that refers to the other
+// threads is dropped in the child. Whatever sat in their caches is lost.
+
+void fork_prepare() { pthread_mutex_lock(&NA.lock); }
+
+void fork_parent() { pthread_mutex_unlock(&NA.lock); }
 
-    return NULL;
+void fork_child() {
+    collector_after_fork();
+    pthread_mutex_unlock(&NA.lock);
 }
 
+/// Sets up the heap, before `main` or on the first call to `malloc`, whichever
+/// comes first
 __attribute__((constructor)) void new_allocator() {
+    if (NA.initialized)
+        return;
+
+    pthread_mutex_init(&NA.lock, NULL);
+    pthread_key_create(&thread_cache_key, destroy_thread);
+    init_collector();
+
     NA.headers = BL_new();
 
-    NA.free_headers = BRL_new();
-    NA.used_headers = BRL_new();
+    memset(NA.bins, 0xff, sizeof(NA.bins));
+    NA.bin_map = 0;
+    NA.nursery = BLOCK_NONE;
+
+    NA.page_map = PM_new();
+    NA.growth = 2 * INITIAL_ALLOCATOR_SIZE;
+    NA.large = BLOCK_NONE;
+    NA.purge_decay = PURGE_DECAY;
+
+    // Nothing is committed yet, the reservation is trimmed down to the part
+    // that starts on a huge page
+    uint8_t* reserved = map_reserve(HEAP_RESERVE + HUGE_PAGE_SIZE);
+    if (reserved != MAP_FAILED) {
+        NA.reserved = (uint8_t*)(((uintptr_t)reserved + HUGE_PAGE_SIZE - 1) &
+                                 ~(HUGE_PAGE_SIZE - 1));
+        if (NA.reserved > reserved)
+            munmap(reserved, NA.reserved - reserved);
+        munmap(NA.reserved + HEAP_RESERVE,
+               reserved + HUGE_PAGE_SIZE - NA.reserved);
+    }
 
-    void* ptr = map_new(INITIAL_ALLOCATOR_SIZE);
-    if (ptr == NULL) {
+    void* ptr = heap_map(INITIAL_ALLOCATOR_SIZE);
+    if (ptr == MAP_FAILED) {
         printf("Failed to allocate first block of allocator\n");
         exit(1);
     }
 
-    size_t first_header_idx =
-        BL_new_header(&NA.headers, INITIAL_ALLOCATOR_SIZE, ptr);
-    BRL_push(&NA.free_headers, first_header_idx);
+    PM_map(&NA.page_map, ptr, INITIAL_ALLOCATOR_SIZE);
+    uint32_t idx = new_free_header(ptr, INITIAL_ALLOCATOR_SIZE);
+    BL_idx(&NA.headers, idx)->flags |= BLOCK_ZERO;
+    NA.mapped = INITIAL_ALLOCATOR_SIZE;
 
-    bottom_of_stack = (uintptr_t)__builtin_stack_address();
+#ifdef NARSIRABAD_TRACE
+    nar_trace_init();
+#endif
 
-    // TODO Verify that they're contiguous in memory
-    start_of_bss = (uintptr_t)&__bss_start;
-    end_of_bss = (uintptr_t)&__data_start;
+    // The main thread is registered from here, where we know roughly where
+    // its stack begins
+    mutator.bottom_of_stack = (uintptr_t)__builtin_stack_address();
+    register_mutator();
+
+    NA.initialized = true;
+
+    // Last, `pthread_atfork` may allocate
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
 }
 /// This destructor will fail if not all blocks have be deallocated
 __attribute__((destructor)) void destroy_allocator() {
-    for (int i = 0; i < NA.used_headers.len; i++) {
-        size_t block_idx = NA.used_headers.arr[i];
-        Block* block = BRL_idx(&NA.used_headers, i);
-
-        // We don't want to call free_block, because then we would traverse the
-        // `NA.used_headers` to remove it, instead of just freeing the whole
-        // array at the end
-        BRL_push(&NA.free_headers, block_idx);
-
-        block->size += block->offset;
-        block->offset = 0;
-    }
-    BRL_free(&NA.used_headers);
-
-    try_merge_block(0);
+    if (NA.keep_at_exit)
+        return;
 
     for (int i = 0; i < NA.headers.len; i++) {
         Block* header = BL_idx(&NA.headers, i);
-        assert(header->ptr != NULL);
+        // Only the first block of every mapping, the rest are unmapped with it
+        if (header->ptr == NULL || header->prev_phys != BLOCK_NONE)
+            continue;
 
-        int unmap_result = munmap(header->ptr, header->size + header->offset);
+        Block* last = header;
+        while (last->next_phys != BLOCK_NONE)
+            last = BL_idx(&NA.headers, last->next_phys);
+
+        size_t mapping_size =
+            (uint8_t*)last->ptr + last->size - (uint8_t*)header->ptr;
+
+        int unmap_result = munmap(header->ptr, mapping_size);
         if (unmap_result == -1) {
             printf("Failed to unnmap block\n");
             exit(1);
         }
     }
 
+    // What was never committed is still reserved
+    if (NA.reserved != NULL)
+        munmap(NA.reserved, HEAP_RESERVE);
+
     BL_free(&NA.headers);
+    PM_free(&NA.page_map);
+}
+
+/// Collects to make room for an allocation of `size` bytes aligned to
+/// `alignment`, and takes it if there is enough room afterwards
+///
+/// Returns `NULL` if the heap has to grow
+void* collect_for(uint32_t size, size_t alignment, bool zero) {
+    void* ptr;
+    size_t needed = round_size(size) + sizeof(BlockTag);
+    if (NA.generational && needed <= NURSERY_MAX_OBJECT &&
+        alignment <= ALIGNMENT) {
+        // The nursery ran out, most of what's in it should be garbage by now
+        collect_minor();
+
+        // A nursery that can only come from new memory is a sign that the old
+        // generation is full of garbage too, once it's grown to its goal
+        if (!renew_nursery(false)) {
+            if (NC.gc_percent < 0 || collection_due(0))
+                collect();
+            renew_nursery(true);
+        }
+
+        ptr = try_allocate(size, alignment, zero);
+        if (ptr != NULL)
+            return ptr;
+    }
+
+    // The heap grows until the next collection is due
+    if (NC.gc_percent >= 0 && !collection_due(needed))
+        return NULL;
+
+    if (NC.incremental) {
+        // Nothing is freed until the cycle is over, the heap grows until then
+        collect_incremental();
+        return NULL;
+    }
+
+    // The sweep merges every collected block with its neighbours, so we might
+    // now fit a size larger than any individual block that was collected
+    collect();
+
+    return try_allocate(size, alignment, zero);
+}
+
+/// The part of `allocate` that needs the lock, it may collect and expand the
+/// heap
+void* allocate_locked(uint32_t size, size_t alignment, bool zero) {
+    purge_tick();
+
+    // Not even the pause that ends a cycle while collections are disabled
+    if (NC.incremental && !NC.disabled)
+        collect_step();
+
+    // Large blocks that have to be aligned further are left to the heap, their
+    // mappings are only aligned to pages
+    size_t needed = round_size(size) + sizeof(BlockTag);
+    if (needed >= LARGE_OBJECT_SIZE && alignment <= ALIGNMENT) {
+        uint32_t block_idx = map_large(needed);
+        if (block_idx == BLOCK_NONE)
+            return NULL;
+
+        void* data = tag_block(block_idx);
+        clear_data(data,
+                   BL_idx(&NA.headers, block_idx)->size - sizeof(BlockTag), 0);
+        return data;
+    }
+
+    if (collection_due(needed))
+        collect_paced();
+
+    void* ptr = try_allocate(size, alignment, zero);
+    if (ptr != NULL)
+        return ptr;
+
+    // With collections off, the heap only grows
+    if (!NC.disabled) {
+        ptr = collect_for(size, alignment, zero);
+        if (ptr != NULL)
+            return ptr;
+    }
+
+    uint32_t block_idx;
+    if (alignment <= ALIGNMENT) {
+        block_idx = expand_memory(needed);
+        if (block_idx == BLOCK_NONE)
+            return NULL;
+
+        // The rest of the mapping goes to the bins
+        try_split_block(block_idx, needed);
+    } else {
+        // Mappings are only aligned to pages, the block may start further in
+        block_idx = expand_memory(needed + alignment - ALIGNMENT);
+        if (block_idx == BLOCK_NONE)
+            return NULL;
+
+        count_block(BL_idx(&NA.headers, block_idx), false);
+        BL_idx(&NA.headers, block_idx)->flags |= BLOCK_FREE;
+        count_block(BL_idx(&NA.headers, block_idx), true);
+        bin_insert(block_idx);
+
+        block_idx = take_aligned(block_idx, needed, alignment);
+    }
+
+    // Fresh mappings are already zeroed, this only clears the tag's flag
+    void* data = tag_block(block_idx);
+    clear_data(data, BL_idx(&NA.headers, block_idx)->size - sizeof(BlockTag),
+               0);
+
+    return data;
+}
+
+/// Takes the lock for `allocate_locked`, recording where the calling thread's
+/// stack ends in case it collects
+///
+/// Kept out of line so that the fast path doesn't pay for spilling registers
+__attribute__((noinline)) void* allocate_slow(uint32_t size,
+                                              size_t alignment, bool zero) {
+    // Spills the registers the caller might keep pointers in into this frame,
+    // above the address taken below
+    __builtin_unwind_init();
+
+    // We need to get it here because otherwise we'd be looking the allocator's
+    // stack frames if we end up garbage collecting, which would obviously lead
+    // to not freeing blocks that could be
+    uintptr_t stack_address = (uintptr_t)__builtin_stack_address();
+
+    pthread_mutex_lock(&NA.lock);
+    mutator.top_of_stack = stack_address;
+    void* ptr = allocate_locked(size, alignment, zero);
+    pthread_mutex_unlock(&NA.lock);
+
+    return ptr;
+}
+
+/*
+ * Everything `allocate` and its variants do, small blocks that need no more
+ * than `ALIGNMENT` come from the calling thread's cache.
+ *
+ * `zero` - Whether the first `size` bytes have to be zeroed, the rest of the
+ * block always is
+ */
+void* allocate_block(uint32_t size, size_t alignment, bool zero) {
+    if (!thread_cache.initialized)
+        init_thread();
+
+    count_event(&mutator.allocations);
+
+    void* ptr = NULL;
+    size_t needed = round_size(size) + sizeof(BlockTag);
+    // A thread that is exiting has no cache any more
+    if (needed <= SMALL_BIN_MAX && alignment <= ALIGNMENT &&
+        thread_cache.initialized) {
+        ptr = cache_pop(bin_index(needed));
+        if (ptr != NULL)
+            clear_data(ptr, needed - sizeof(BlockTag), zero ? 0 : size);
+    }
+
+    if (ptr == NULL)
+        ptr = allocate_slow(size, alignment, zero);
+
+    NAR_TRACE(NAR_EVENT_ALLOCATE, ptr, size);
+    return ptr;
+}
+
+// Resizing
+
+/*
+ * Grows a used block in place to `needed` bytes by taking the front of the
+ * free block right after it, or all of it if too little would be left.
+ * Everything past the old end reads as zero, like a new block.
+ *
+ * Returns whether there was enough room, the caller updates the page map
+ */
+bool grow_block(uint32_t block_idx, size_t needed) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+    uint32_t next_idx = header->next_phys;
+    if (!is_mergeable(next_idx))
+        return false;
+
+    Block* next = BL_idx(&NA.headers, next_idx);
+    size_t old_size = header->size;
+    size_t extra = needed - old_size;
+    if (next->size < extra)
+        return false;
+
+    bool zero = next->flags & BLOCK_ZERO;
+
+    bin_remove(next_idx);
+    count_block(header, false);
+    count_block(next, false);
+    if (next->size - extra > NEW_BLOCK_THRESHOLD) {
+        next->ptr = (uint8_t*)next->ptr + extra;
+        next->size -= extra;
+        count_block(next, true);
+        bin_insert(next_idx);
+
+        header->size = needed;
+    } else {
+        header->size += next->size;
+
+        header->next_phys = next->next_phys;
+        if (next->next_phys != BLOCK_NONE)
+            BL_idx(&NA.headers, next->next_phys)->prev_phys = block_idx;
+
+        BL_drop_header(&NA.headers, next_idx);
+    }
+    count_block(header, true);
+
+    if (!zero)
+        memset((uint8_t*)header->ptr + old_size, 0, header->size - old_size);
+
+    return true;
+}
+
+/*
+ * Moves a used block that has its mapping to itself, save for a free block at
+ * the end, to a mapping of at least `needed` bytes with `mremap`, which moves
+ * the pages rather than copying them.
+ *
+ * Returns whether the block was moved
+ *
+ * WARNING
+ * This function has the potential to reallocate the `NA.headers` list.
+ */
+bool remap_block(uint32_t block_idx, size_t needed) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+    if (header->prev_phys != BLOCK_NONE || needed < REMAP_THRESHOLD)
+        return false;
+
+    // Moving a chunk out of the reservation would leave a hole in it that
+    // anything else could be mapped into
+    if (NA.reserved != NULL && (uint8_t*)header->ptr >= NA.reserved &&
+        (uint8_t*)header->ptr < NA.reserved + HEAP_RESERVE)
+        return false;
+
+    // Pages written to during a cycle are only known by their address, the
+    // block is copied instead so the writes are tracked where it ends up
+    if (NC.cycle_active)
+        return false;
+
+    uint32_t tail_idx = header->next_phys;
+    size_t old_size = header->size;
+    bool tail_zero = true;
+    if (tail_idx != BLOCK_NONE) {
+        Block* tail = BL_idx(&NA.headers, tail_idx);
+        if (!is_mergeable(tail_idx) || tail->next_phys != BLOCK_NONE)
+            return false;
+
+        old_size += tail->size;
+        tail_zero = tail->flags & BLOCK_ZERO;
+    }
+
+    size_t page_size = getpagesize();
+    size_t new_size = (needed + page_size - 1) & ~(page_size - 1);
+
+    void* ptr = mremap(header->ptr, old_size, new_size, MREMAP_MAYMOVE);
+    if (ptr == MAP_FAILED)
+        return false;
+
+    // Pages past the old mapping are fresh, only the old free tail may not be
+    if (!tail_zero)
+        memset((uint8_t*)ptr + header->size, 0, old_size - header->size);
+
+    if (tail_idx != BLOCK_NONE) {
+        bin_remove(tail_idx);
+        count_block(BL_idx(&NA.headers, tail_idx), false);
+        BL_drop_header(&NA.headers, tail_idx);
+        header->next_phys = BLOCK_NONE;
+    }
+
+    // Nothing of the old mapping is left for a collection to look at
+    PM_unmap(&NA.page_map, header->ptr, old_size);
+    PM_map(&NA.page_map, ptr, new_size);
+    track_mapping(ptr, new_size);
+    __atomic_fetch_add(&NA.mapped, new_size - old_size, __ATOMIC_RELAXED);
+
+    // The block may have moved away from the cards that held its pointers
+    if (NA.generational) {
+        for (size_t card = 0; card < new_size; card += PM_CARD_SIZE)
+            PM_dirty_card(&NA.page_map, (uint8_t*)ptr + card);
+    }
+
+    count_block(header, false);
+    header->ptr = ptr;
+    header->size = new_size;
+    count_block(header, true);
+    if (!(header->flags & BLOCK_LARGE))
+        try_split_block(block_idx, needed);
+
+    return true;
+}
+
+/*
+ * Resizes a used block to `needed` bytes without copying it: shrinking splits
+ * off the end, growing takes the free block after it or remaps its pages.
+ *
+ * Returns the address the block is now at, or `NULL` if it has to be moved by
+ * copying it
+ *
+ * WARNING
+ * This function has the potential to reallocate the `NA.headers` list.
+ */
+void* resize_block(uint32_t block_idx, size_t needed) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+    size_t old_size = header->size;
+
+    // Large blocks are only ever made of whole pages
+    size_t slack = header->flags & BLOCK_LARGE ? getpagesize() - 1
+                                               : NEW_BLOCK_THRESHOLD;
+    if (needed <= old_size && old_size - needed <= slack)
+        return block_data(header);
+
+    // The block is taken out of the page map with its old extent
+    PM_remove_block(&NA.page_map, header);
+
+    if (header->flags & BLOCK_LARGE) {
+        if (needed < old_size) {
+            shrink_large(block_idx, needed);
+        } else if (!remap_block(block_idx, needed)) {
+            PM_add_block(&NA.page_map, block_idx, header);
+            return NULL;
+        }
+    } else if (needed < old_size) {
+        try_split_block(block_idx, needed);
+
+        // What was split off may go with whatever is free after it
+        header = BL_idx(&NA.headers, block_idx);
+        try_merge_block(header->next_phys);
+    } else if (!grow_block(block_idx, needed) &&
+               !remap_block(block_idx, needed)) {
+        PM_add_block(&NA.page_map, block_idx, header);
+        return NULL;
+    }
+
+    header = BL_idx(&NA.headers, block_idx);
+    void* data = block_data(header);
+    ((BlockTag*)data - 1)->bin = bin_index(header->size);
+    PM_add_block(&NA.page_map, block_idx, header);
+
+    return data;
 }
 
 // EXPOSED FUNCTIONS
@@ -320,65 +1503,189 @@ __attribute__((destructor)) void destroy_allocator() {
 // There's an issue where you can just write into another allocation if a larger
 // block is split. I don't exactly know how to make the write fail, not sure if
 // that's what it should do.
-void* allocate(uint32_t size) {
-    // We need to get it here because otherwise we'd be looking the allocator's
-    // stack frames if we end up garbage collecting, which would obviously lead
-    // to not freeing blocks that could be
-    top_of_stack = (uintptr_t)__builtin_stack_address();
+void* allocate(uint32_t size) { return allocate_block(size, ALIGNMENT, true); }
 
-    void* ptr = try_allocate(size);
-    if (ptr != NULL)
-        return ptr;
+void* allocate_aligned(uint32_t size, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
 
-    printf("Not found\n");
+    return allocate_block(size, alignment, true);
+}
 
-    // WARNING
-    // We need to merge all blocks because we might be trying to allocate a size
-    // larger than any individual blocks, but can fit in the aggregate size of
-    // collected blocks
-    //
-    // However, we're going to go ahead and split them again anyway, which might
-    // end up being really inefficient
-    garbage_collect();
-    printf("After GC:\n");
-    print_headers();
+void* allocate_uninit(uint32_t size) {
+    return allocate_block(size, ALIGNMENT, false);
+}
 
-    try_merge_block(0);
+void* allocate_atomic(uint32_t size) {
+    void* ptr = allocate_block(size, ALIGNMENT, false);
 
-    printf("After Merging:\n");
-    print_headers();
+    // Until this is set the block is scanned like any other, which is only
+    // ever too cautious
+    if (ptr != NULL)
+        ((BlockTag*)ptr - 1)->atomic = true;
 
-    ptr = try_allocate(size);
-    if (ptr != NULL) {
-        return ptr;
-    }
+    return ptr;
+}
 
-    bool expand_success = expand_memory(size);
-    if (!expand_success)
+void* allocate_typed(uint32_t size, uint16_t layout) {
+    if (layout == 0 || layout > __atomic_load_n(&NC.layout_count,
+                                                __ATOMIC_ACQUIRE))
         return NULL;
 
-    printf("After Expanding:\n");
-    print_headers();
+    void* ptr = allocate_block(size, ALIGNMENT, true);
 
-    Block* block = BRL_idx(&NA.used_headers, NA.used_headers.len - 1);
+    // Scanned as a whole until then, like `allocate_atomic`
+    if (ptr != NULL)
+        ((BlockTag*)ptr - 1)->layout = layout;
 
-    try_split_block(NA.used_headers.len - 1, size);
+    return ptr;
+}
 
-    return block->ptr;
+void gc_register_thread() {
+    if (!thread_cache.initialized)
+        init_thread();
+}
+
+void gc_enable_generational() {
+    pthread_mutex_lock(&NA.lock);
+    if (!NA.generational) {
+        NA.generational = true;
+        renew_nursery(true);
+    }
+    pthread_mutex_unlock(&NA.lock);
 }
 
 void deallocate(void* ptr) {
-    printf("Deallocating %p:\n", ptr);
-    print_headers();
+    if (ptr == NULL)
+        return;
 
-    for (int i = 0; i < NA.used_headers.len; i++) {
-        Block* header = BRL_idx(&NA.used_headers, i);
-        if (header->ptr != (uint8_t*)ptr + header->offset)
-            continue;
+    // A large block that was freed isn't mapped any more, so its tag can only
+    // be read once the page map says it's still there
+    if (((uintptr_t)ptr & (PM_PAGE_SIZE - 1)) == sizeof(BlockTag) &&
+        PM_find(&NA.page_map, ptr) == BLOCK_NONE)
+        return;
+
+    // Blocks we never handed out, blocks that were already freed, and blocks
+    // that already sit in a cache are all ignored
+    BlockTag* tag = (BlockTag*)ptr - 1;
+    if (tag->magic != BLOCK_MAGIC || tag->cached)
+        return;
+
+    if (!thread_cache.initialized)
+        init_thread();
+
+    count_event(&mutator.frees);
+    NAR_TRACE(NAR_EVENT_FREE, ptr, 0);
 
-        free_block(header);
-        try_merge_block(NA.free_headers.len - 1);
+    if (tag->bin < SMALL_BIN_COUNT && thread_cache.initialized) {
+        cache_push(tag->bin, ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&NA.lock);
+    purge_tick();
+    uint32_t block_idx = tagged_block(ptr);
+    if (block_idx != BLOCK_NONE) {
+        if (BL_idx(&NA.headers, block_idx)->flags & BLOCK_LARGE) {
+            free_large(block_idx);
+        } else {
+            free_block(block_idx);
+            try_merge_block(block_idx);
+        }
+    }
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void purge_free_memory() {
+    pthread_mutex_lock(&NA.lock);
+    purge_blocks(UINT64_MAX);
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void set_purge_decay(uint64_t decay) {
+    pthread_mutex_lock(&NA.lock);
+    NA.purge_decay = decay;
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void use_huge_pages(bool enabled) {
+    pthread_mutex_lock(&NA.lock);
+    NA.huge_pages = enabled;
+    if (NA.reserved != NULL && NA.committed > 0)
+        map_huge(NA.reserved, NA.committed, enabled);
+    pthread_mutex_unlock(&NA.lock);
+}
+
+size_t usable_size(void* ptr) {
+    if (ptr == NULL)
+        return 0;
+
+    BlockTag* tag = (BlockTag*)ptr - 1;
+    if (tag->magic != BLOCK_MAGIC)
+        return 0;
+
+    // Small blocks are exactly the size of their class
+    if (tag->bin < SMALL_BIN_COUNT)
+        return (tag->bin + 1) * ALIGNMENT - sizeof(BlockTag);
 
-        break;
+    size_t size = 0;
+    pthread_mutex_lock(&NA.lock);
+    uint32_t block_idx = tagged_block(ptr);
+    if (block_idx != BLOCK_NONE) {
+        Block* header = BL_idx(&NA.headers, block_idx);
+        size = header->size - sizeof(BlockTag);
     }
+    pthread_mutex_unlock(&NA.lock);
+
+    return size;
+}
+
+void* reallocate(void* ptr, uint32_t size) {
+    if (ptr == NULL)
+        return allocate(size);
+
+    BlockTag* tag = (BlockTag*)ptr - 1;
+    if (tag->magic != BLOCK_MAGIC || tag->cached)
+        return NULL;
+
+    if (!thread_cache.initialized)
+        init_thread();
+
+    size_t needed = round_size(size) + sizeof(BlockTag);
+    size_t old_size = 0;
+    void* resized = NULL;
+
+    pthread_mutex_lock(&NA.lock);
+    uint32_t block_idx = tagged_block(ptr);
+    if (block_idx != BLOCK_NONE) {
+        Block* header = BL_idx(&NA.headers, block_idx);
+        old_size = header->size - sizeof(BlockTag);
+        resized = resize_block(block_idx, needed);
+
+        // What is left past `size` of a block that shrank reads as zero again
+        if (resized != NULL && size < old_size) {
+            header = BL_idx(&NA.headers, block_idx);
+            memset((uint8_t*)resized + size, 0,
+                   header->size - sizeof(BlockTag) - size);
+        }
+    }
+    pthread_mutex_unlock(&NA.lock);
+
+    if (block_idx == BLOCK_NONE || resized != NULL)
+        return resized;
+
+    // Nothing to grow into, the block has to be copied
+    uint8_t* new_ptr = allocate_uninit(size);
+    if (new_ptr == NULL)
+        return NULL;
+
+    memcpy(new_ptr, ptr, old_size);
+    memset(new_ptr + old_size, 0, size - old_size);
+
+    // The copy is scanned the same way, see `allocate_atomic`
+    ((BlockTag*)new_ptr - 1)->atomic = tag->atomic;
+    ((BlockTag*)new_ptr - 1)->layout = tag->layout;
+    deallocate(ptr);
+
+    return new_ptr;
 }
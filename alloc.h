@@ -2,46 +2,484 @@
 
 #define NARSIRABAD_ALLOC
 
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <ucontext.h>
+
+// Every block size and every block pointer is a multiple of this
+#define ALIGNMENT 16
+
+// Sentinel index meaning "no block", used to terminate the bin lists
+#define BLOCK_NONE UINT32_MAX
+
+// `Block.flags`
+#define BLOCK_FREE 0x1
+// The block is a slab of a `Pool`, mapped on its own and never freed to the
+// bins, the collector marks and sweeps its slots one by one
+#define BLOCK_POOL 0x2
+// The block's memory is known to be all zero, as it is for fresh mappings.
+// Only kept until the block is handed out, whoever uses it writes to it
+#define BLOCK_ZERO 0x4
+// The block has a mapping to itself and sits in `NA.large` rather than the
+// bins, freeing it unmaps it
+#define BLOCK_LARGE 0x8
+
+// Written into every `BlockTag`, so that `deallocate` can tell a tag apart
+// from arbitrary memory
+#define BLOCK_MAGIC 0x6e617221
+
+// Size classes
+//
+// Blocks of up to `SMALL_BIN_MAX` bytes get an exact class per `ALIGNMENT`
+// bytes, so a small request is served by popping the head of its own bin.
+// Everything larger is grouped into power-of-two classes, the last of which
+// is unbounded.
+#define SMALL_BIN_COUNT 32
+#define SMALL_BIN_MAX (SMALL_BIN_COUNT * ALIGNMENT)
+#define SMALL_BIN_SHIFT 9
+#define BIN_COUNT 64
 
 typedef struct {
-    uint8_t offset;
+    uint8_t flags;
     size_t size;
     void* ptr;
+    // While the block is free, its neighbours in the bin it sits in
+    // While the block is large, its neighbours in `NA.large`
+    // While the header is vacant, `next_free` is the next vacant header
+    uint32_t next_free;
+    uint32_t prev_free;
+    // The blocks directly before and after this one in memory, `BLOCK_NONE`
+    // at the edges of a mapping
+    uint32_t prev_phys;
+    uint32_t next_phys;
+    // While the block is free, `NA.purge_clock` as of when it was freed
+    uint64_t freed_at;
 } Block;
 
+// The inline part of a block's metadata
+//
+// Sits directly in front of the memory handed out for every used block, so
+// that the block's header can be found from the user's pointer alone.
+// Everything else about the block lives in its header, which keeps
+// `NA.headers` the only source of truth.
+typedef struct {
+    uint32_t idx;
+    uint32_t magic;
+    // The size class of the block, copied here so that thread caches can file
+    // a block without taking the lock to read its header
+    uint8_t bin;
+    // Whether the block currently sits in a thread cache
+    uint8_t cached;
+    // Whether the block was handed out since the last collection that promoted
+    // its survivors, only minor collections tell the difference
+    uint8_t young;
+    // `Collector.epoch` when the block was handed out, blocks handed out during
+    // an incremental cycle are taken to be alive by it
+    uint8_t epoch;
+    // Whether the block's data is still known to be all zero, from when it's
+    // taken from the heap until it's handed out
+    uint8_t zeroed;
+    // Whether the block was handed out by `allocate_atomic`, the collector
+    // keeps it alive but never looks inside it. Kept here rather than in the
+    // header's flags, since a block popped from a thread cache has no lock held
+    uint8_t atomic;
+    // The layout the block was handed out with by `allocate_typed`, `0` for
+    // blocks whose every word is scanned
+    uint16_t layout;
+} BlockTag;
+
+// Generational mode
+//
+// Small blocks are bumped off the front of the nursery, a free block that is
+// kept out of the bins. Once it runs out, a minor collection frees the young
+// blocks nothing points to and promotes the rest in place, and a new nursery is
+// taken from the heap.
+#define NURSERY_SIZE (1ul << 20)
+// Anything larger is taken from the bins, still young
+#define NURSERY_MAX_OBJECT (64ul << 10)
+
+// Thread caches
+//
+// Every thread keeps a few free blocks of each small size class to itself, so
+// that most calls to `allocate` and `deallocate` never take `NA.lock`. Blocks
+// move between a cache and the heap `TCACHE_BATCH` at a time.
+#define TCACHE_MAX 32
+#define TCACHE_BATCH 16
+// A refill takes fewer blocks of the larger classes, about this many bytes
+#define TCACHE_REFILL_BYTES 4096
+
+// Heap growth
+//
+// Every mapping added to the heap is twice as large as the last one, up to
+// `HEAP_GROWTH_MAX`, so a heap that keeps growing takes few system calls.
+#define HEAP_GROWTH_MAX (32ul << 20)
+// The heap's mappings are taken in order from a range of this many bytes that
+// is reserved up front, so the heap stays in one place. Only once it's used up
+// do they go wherever the kernel puts them
+#define HEAP_RESERVE (64ul << 30)
+// The reserved range starts on a multiple of this, so huge pages can back it
+#define HUGE_PAGE_SIZE (2ul << 20)
+
+// Large objects
+//
+// Blocks of at least `LARGE_OBJECT_SIZE` get a mapping to themselves, which
+// is unmapped as soon as the block is freed. Rather than running out of the
+// bins, they collect once more than half of the heap was handed out to them
+// since the last collection.
+#define LARGE_OBJECT_SIZE (256ul << 10)
+
+// Purging
+//
+// The whole pages inside a free block that has been left alone for
+// `NA.purge_decay` nanoseconds are handed back to the kernel with
+// `MADV_DONTNEED`, which leaves them mapped but reading as zero. Blocks are
+// only looked at when a thread takes the lock, a few times per period.
+#define PURGE_DECAY (10ul * 1000 * 1000 * 1000)
+#define PURGE_CHECKS 4
+// Blocks with fewer bytes of whole pages are never purged
+#define PURGE_MIN_SIZE (64ul << 10)
+// A collection that frees at least `1 / PURGE_COLLECT_SHARE` of the heap
+// purges every free block right away
+#define PURGE_COLLECT_SHARE 4
+
+typedef struct {
+    // Singly linked through the first word of each block's memory
+    void* heads[SMALL_BIN_COUNT];
+    uint32_t counts[SMALL_BIN_COUNT];
+    bool initialized;
+    // Set once the cache was flushed for good, anything the thread frees while
+    // it exits goes straight to the heap
+    bool exited;
+} ThreadCache;
+
+// Signals the collecting thread uses to stop every other thread while it
+// collects, and to let them go again
+#define SIG_SUSPEND SIGPWR
+#define SIG_RESUME SIGXCPU
+
+// A thread whose stack and registers every collection scans
+//
+// Threads register themselves the first time they use the heap, and are
+// removed when they exit.
+typedef struct Mutator {
+    pthread_t thread;
+    bool registered;
+    uintptr_t bottom_of_stack;
+    // Where the stack ended when the thread was last stopped, or for the
+    // collecting thread, where it was when it started collecting
+    uintptr_t top_of_stack;
+    // The registers of the thread when it was last stopped
+    mcontext_t registers;
+    // Calls to `allocate` and `deallocate` by the thread, and the blocks in its
+    // cache, only ever written by the thread itself
+    uint64_t allocations;
+    uint64_t frees;
+    size_t bytes_cached;
+    size_t blocks_cached;
+    struct Mutator* prev;
+    struct Mutator* next;
+} Mutator;
+
 // A list of all headers `List<Block>`
+//
+// Indices into this list are stable for the lifetime of a block, headers that
+// are no longer needed are recycled through `vacant` instead of being removed
 typedef struct {
     Block* arr;
     // These are counts of block, not amount of memory remaining
     uint32_t len;
     uint32_t cap;
+    // Head of the chain of vacant headers
+    uint32_t vacant;
 } BlockList;
 
-// A list containing indicies of headers in `NA.headers`
+// Page map
 //
-// This structure should only have two instances: `NA.free_headers` and
-// `NA.used_headers` `List<Block*>`
+// A three-level radix tree keyed by page number, mapping any address inside the
+// heap to the block that owns it. Every level resolves `PM_LEVEL_BITS` bits of
+// the page number, which covers a 48-bit address space.
+#define PM_PAGE_SHIFT 12
+#define PM_PAGE_SIZE (1ul << PM_PAGE_SHIFT)
+#define PM_LEVEL_BITS 12
+#define PM_FANOUT (1ul << PM_LEVEL_BITS)
+#define PM_GRANULES (PM_PAGE_SIZE / ALIGNMENT)
+
+// Cards the write barrier dirties, several per page
+#define PM_CARD_SHIFT 9
+#define PM_CARD_SIZE (1ul << PM_CARD_SHIFT)
+#define PM_CARDS (PM_PAGE_SIZE / PM_CARD_SIZE)
+
 typedef struct {
-    size_t* arr;
-    // These are counts of block, not amount of memory remaining
-    uint32_t len;
-    uint32_t cap;
-} BlockRefList;
+    // One bit per `ALIGNMENT` bytes of the page, set where the tag of a used
+    // block sits
+    uint64_t starts[PM_GRANULES / 64];
+    // Set for every card a pointer was written into since the last collection
+    uint8_t cards[PM_CARDS];
+    // Set when the page was written to during an incremental cycle
+    uint8_t written;
+    // The index + 1 of the used block that runs into this page from an earlier
+    // one, `0` when there is none
+    uint32_t covering;
+} PageEntry;
+
+typedef struct {
+    PageEntry pages[PM_FANOUT];
+} PageMapLeaf;
+
+typedef struct {
+    PageMapLeaf* leaves[PM_FANOUT];
+} PageMapNode;
+
+typedef struct {
+    PageMapNode** nodes;
+    // Bounds of everything ever added to the map, anything outside of them can
+    // be rejected without touching the tree
+    uintptr_t min;
+    uintptr_t max;
+} PageMap;
+
+// Arenas
+//
+// Memory bumped off chunks mapped for the arena alone, all of it freed at once
+// by resetting the arena. Chunks are kept across resets and reused in order.
+#define ARENA_CHUNK_SIZE (64ul << 10)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    // How far the chunk was filled before the arena moved on to the next one
+    uint8_t* used;
+} ArenaChunk;
+
+typedef struct Arena {
+    // The chunk the `Arena` itself lives in, at the head of the chain
+    ArenaChunk* first;
+    ArenaChunk* current;
+    uint8_t* ptr;
+    uint8_t* end;
+    size_t chunk_size;
+
+    // Arenas the collector scans, linked through `NA.arenas`
+    bool roots;
+    struct Arena* prev;
+    struct Arena* next;
+} Arena;
+
+// Object pools
+//
+// A pool hands out objects of a single size from slabs that are carved into
+// equal slots. Every slab is a mapping of its own, aligned to its size, so the
+// slab an object belongs to is found by masking its address. Free slots are
+// linked through their first word, the only other metadata is a few bits per
+// slot in the slab's header.
+#define POOL_SLAB_SIZE 4096
+// Slabs grow past `POOL_SLAB_SIZE` until at least this many slots fit
+#define POOL_MIN_SLOTS 8
+
+typedef struct PoolSlab {
+    struct Pool* pool;
+    struct PoolSlab* next;
+    uint8_t* slots;
+    uint32_t count;
+    // Set while the slab sits in a mark deque with slots left to scan
+    uint32_t queued;
+    // One bit per slot each: handed out, marked, and scanned by the collector
+    uint64_t* allocated;
+    uint64_t* marks;
+    uint64_t* scanned;
+} PoolSlab;
+
+typedef struct Pool {
+    // The distance between two slots, a multiple of `align`
+    size_t size;
+    size_t align;
+    size_t slab_size;
+    // Where the first slot of every slab starts, and how many slots follow
+    size_t first;
+    uint32_t count;
+
+    // Owned by the thread using the pool
+    void* free;
+    // Slots the collector found unreachable, taken by the owner all at once
+    void* reclaimed;
+
+    PoolSlab* slabs;
+    // Every pool, linked through `NA.pools`
+    struct Pool* prev;
+    struct Pool* next;
+} Pool;
 
 typedef struct Allocator {
+    // Guards everything below, thread caches are the only thing that can be
+    // touched without it
+    pthread_mutex_t lock;
+
     BlockList headers;
 
-    BlockRefList free_headers;
-    BlockRefList used_headers;
+    // Heads of the free lists for every size class, indices into `headers`
+    uint32_t bins[BIN_COUNT];
+    // Bit `n` is set when `bins[n]` is non-empty
+    uint64_t bin_map;
+
+    PageMap page_map;
+
+    // Every registered thread, linked through `Mutator.next`
+    Mutator* mutators;
+
+    // Every arena registered as roots, linked through `Arena.next`
+    Arena* arenas;
+
+    // Every pool, linked through `Pool.next`
+    Pool* pools;
+
+    // Bytes mapped for the heap, pool slabs and arena chunks, only ever changed
+    // atomically since arenas don't take the lock
+    size_t mapped;
+    // `Mutator.allocations` and `Mutator.frees` of threads that have exited
+    uint64_t allocations;
+    uint64_t frees;
+    // Bytes and blocks in `headers`, large blocks among the used ones, see
+    // `count_block`
+    size_t bytes_free;
+    size_t blocks_free;
+    size_t bytes_used;
+    size_t blocks_used;
+    size_t bytes_large;
+    size_t blocks_large;
+
+    // How large the next mapping added to the heap is, see Heap growth above
+    size_t growth;
+    // The range reserved for the heap, `NULL` if it couldn't be, and how much
+    // of it is mapped
+    uint8_t* reserved;
+    size_t committed;
+    // Whether the heap asks for transparent huge pages
+    bool huge_pages;
+
+    // Every large block, linked through `Block.next_free`
+    uint32_t large;
+    // Bytes in used blocks, large blocks and pool slabs included, see Pacing in
+    // `gc.h`. Blocks resized in place aren't accounted for, so it's only exact
+    // right after a sweep, which sets it again
+    size_t in_use;
+
+    // See Purging above, `UINT64_MAX` never purges
+    uint64_t purge_decay;
+    // `now_ns` as of the last time a thread took the lock, free blocks are
+    // stamped with it
+    uint64_t purge_clock;
+    uint64_t last_purge;
+    // Bytes handed back to the kernel, and the `madvise` calls that did
+    size_t purged;
+    uint64_t purges;
+
+    bool generational;
+    // The free block small blocks are bumped off in generational mode,
+    // `BLOCK_NONE` otherwise
+    uint32_t nursery;
+
+    // Set once `new_allocator` has run, `malloc` may get here before it does
+    bool initialized;
+    // Whether the heap is left mapped at exit, since with `malloc` going
+    // through us anything can still free into it after our destructor
+    bool keep_at_exit;
 } Allocator;
 
 bool is_free(Block* header);
 
+// Adds a block to the counts `nar_stats` reads as whatever it is now, or takes
+// it off them. Blocks are taken off before they change and added back after
+void count_block(Block* header, bool add);
+
+void* block_data(Block* header);
+
+void* tag_block(uint32_t block_idx);
+
+void free_block(uint32_t block_idx);
+
+// Unmaps a large block
+void free_large(uint32_t block_idx);
+
+// Purges the free blocks freed at or before `freed_before`
+void purge_blocks(uint64_t freed_before);
+
+uint32_t try_merge_block(uint32_t header_idx);
+
+void new_allocator();
+
 void* allocate(uint32_t size);
 
+/// Like `allocate`, but the returned address is a multiple of `alignment`
+///
+/// The space in front of the block that aligns it stays free for other blocks.
+/// Resizing the block with `reallocate` may move it to an address that is only
+/// aligned to `ALIGNMENT`
+///
+/// Returns `NULL` if `alignment` isn't a power of two, or there is no memory
+/// left
+void* allocate_aligned(uint32_t size, size_t alignment);
+
+/// Like `allocate`, but the first `size` bytes are left as they were, for
+/// callers that overwrite all of them anyway
+///
+/// Until they are overwritten, the collector scans whatever they held, which
+/// may keep garbage alive for a while. The rest of the block is still zeroed
+void* allocate_uninit(uint32_t size);
+
+/// Like `allocate_uninit`, for blocks that never hold pointers, such as
+/// strings, numbers and I/O buffers
+///
+/// The collector keeps the block alive for as long as something points to it,
+/// but never scans its contents, so whatever they hold can't keep other blocks
+/// alive. Resizing the block with `reallocate` keeps it that way
+void* allocate_atomic(uint32_t size);
+
+/// Like `allocate`, for an object or an array of objects laid out as
+/// registered with `register_layout`
+///
+/// The collector only looks at the words the layout says may hold pointers,
+/// repeating it over the whole block, so the scalars in between can't keep
+/// other blocks alive. Resizing the block with `reallocate` keeps its layout
+///
+/// Returns `NULL` if `layout` wasn't registered, or there is no memory left
+void* allocate_typed(uint32_t size, uint16_t layout);
+
 void deallocate(void* ptr);
 
+/// Resizes the block at `ptr` to `size` bytes, keeping its contents
+///
+/// A block shrinks in place, and grows in place when the memory right after it
+/// is free. Large blocks are otherwise moved by remapping their pages, and only
+/// the rest are copied into a new block. Like with `allocate`, everything past
+/// the contents that were kept is zeroed.
+///
+/// Returns where the block is now, `allocate(size)` if `ptr` is `NULL`, or
+/// `NULL` if `ptr` isn't a block we handed out or there is no memory left, in
+/// which case the block is left as it was
+void* reallocate(void* ptr, uint32_t size);
+
+/// Hands the whole pages of every large free block back to the kernel now,
+/// rather than once they have been idle for a while
+void purge_free_memory();
+
+/// Sets how many nanoseconds a free block has to be left alone before its
+/// pages are handed back to the kernel, `PURGE_DECAY` by default
+///
+/// `0` purges blocks as soon as the lock is next taken, `UINT64_MAX` never
+/// does
+void set_purge_decay(uint64_t decay);
+
+/// Asks for the heap to be backed by transparent huge pages, or stops asking
+///
+/// Huge pages take fewer TLB entries for a large heap, but memory is then
+/// handed out and purged in larger pieces. Off by default
+void use_huge_pages(bool enabled);
+
+/// Returns how many bytes can be used at `ptr`, which is at least what was
+/// asked for, or `0` if `ptr` isn't a block we handed out
+size_t usable_size(void* ptr);
+
 #endif
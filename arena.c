@@ -0,0 +1,169 @@
+#include "arena.h"
+#include "alloc.h"
+#include "mem.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define NA NARSIRABAD_ALLOCATOR
+#define ROUND(size) (((size) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+extern Allocator NARSIRABAD_ALLOCATOR;
+
+// Where the memory of a chunk begins, past its header
+uint8_t* chunk_data(ArenaChunk* chunk) {
+    return (uint8_t*)chunk + ROUND(sizeof(ArenaChunk));
+}
+
+// Where the memory of an arena begins, past the arena in its first chunk
+uint8_t* arena_data(Arena* arena) {
+    return (uint8_t*)arena + ROUND(sizeof(Arena));
+}
+
+/*
+ * Maps a chunk that can hold at least `size` bytes past its header.
+ *
+ * Returns `NULL` on failure, or if `size` is too large to round up to pages
+ */
+ArenaChunk* new_chunk(size_t size) {
+    size_t page_size = getpagesize();
+    size_t extra = ROUND(sizeof(ArenaChunk)) + ROUND(sizeof(Arena));
+    if (__builtin_add_overflow(size, extra + page_size - 1, &size))
+        return NULL;
+
+    size &= ~(page_size - 1);
+
+    ArenaChunk* chunk = map_new(size);
+    if (chunk == MAP_FAILED)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = chunk_data(chunk);
+
+    __atomic_fetch_add(&NA.mapped, size, __ATOMIC_RELAXED);
+
+    return chunk;
+}
+
+/*
+ * Makes `chunk` the one allocations are bumped off.
+ */
+void use_chunk(Arena* arena, ArenaChunk* chunk, uint8_t* start) {
+    arena->current = chunk;
+    arena->ptr = start;
+    arena->end = (uint8_t*)chunk + chunk->size;
+}
+
+Arena* arena_create(size_t chunk_size, bool gc_roots) {
+    if (chunk_size == 0)
+        chunk_size = ARENA_CHUNK_SIZE;
+
+    ArenaChunk* chunk = new_chunk(chunk_size);
+    if (chunk == NULL)
+        return NULL;
+
+    // The arena is the first thing in its first chunk
+    Arena* arena = (Arena*)chunk_data(chunk);
+    arena->first = chunk;
+    arena->chunk_size = chunk_size;
+    arena->roots = gc_roots;
+    arena->prev = NULL;
+    arena->next = NULL;
+
+    use_chunk(arena, chunk, arena_data(arena));
+
+    if (gc_roots) {
+        pthread_mutex_lock(&NA.lock);
+        arena->next = NA.arenas;
+        if (NA.arenas != NULL)
+            NA.arenas->prev = arena;
+        NA.arenas = arena;
+        pthread_mutex_unlock(&NA.lock);
+    }
+
+    return arena;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    // No chunk could hold it, and rounding it up would wrap around
+    if (size > SIZE_MAX - ARENA_CHUNK_SIZE)
+        return NULL;
+
+    size = size == 0 ? ALIGNMENT : ROUND(size);
+
+    if ((size_t)(arena->end - arena->ptr) < size) {
+        arena->current->used = arena->ptr;
+
+        // Chunks left over from before a reset come first
+        ArenaChunk* next = arena->current->next;
+        if (next == NULL ||
+            (size_t)((uint8_t*)next + next->size - chunk_data(next)) < size) {
+            next = new_chunk(size > arena->chunk_size ? size
+                                                      : arena->chunk_size);
+            if (next == NULL)
+                return NULL;
+
+            next->next = arena->current->next;
+            arena->current->next = next;
+        }
+
+        use_chunk(arena, next, chunk_data(next));
+    }
+
+    void* ptr = arena->ptr;
+    arena->ptr += size;
+
+    // Memory from before a reset isn't zeroed any more
+    memset(ptr, 0, size);
+
+    return ptr;
+}
+
+/*
+ * Only moves the bump pointer back to the first chunk, no matter how many
+ * chunks the arena has.
+ */
+void arena_reset(Arena* arena) {
+    use_chunk(arena, arena->first, arena_data(arena));
+}
+
+void arena_destroy(Arena* arena) {
+    if (arena->roots) {
+        pthread_mutex_lock(&NA.lock);
+        if (arena->prev != NULL)
+            arena->prev->next = arena->next;
+        else
+            NA.arenas = arena->next;
+
+        if (arena->next != NULL)
+            arena->next->prev = arena->prev;
+        pthread_mutex_unlock(&NA.lock);
+    }
+
+    // The arena goes with its first chunk
+    ArenaChunk* chunk = arena->first;
+    while (chunk != NULL) {
+        ArenaChunk* next = chunk->next;
+        __atomic_fetch_sub(&NA.mapped, chunk->size, __ATOMIC_RELAXED);
+        munmap(chunk, chunk->size);
+        chunk = next;
+    }
+}
+
+void arena_visit_roots(Arena* arena, void (*visit)(uintptr_t* buf, size_t size)) {
+    uint8_t* start = arena_data(arena);
+
+    for (ArenaChunk* chunk = arena->first;; chunk = chunk->next) {
+        uint8_t* end = chunk == arena->current ? arena->ptr : chunk->used;
+        visit((uintptr_t*)start, (end - start) / sizeof(uintptr_t));
+
+        if (chunk == arena->current)
+            return;
+
+        start = chunk_data(chunk->next);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef NARSIRABAD_ARENA
+#define NARSIRABAD_ARENA
+
+#include "alloc.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * `Arena` functions
+ *
+ * An arena belongs to one thread at a time, only registering and unregistering
+ * it as roots takes the allocator's lock.
+ */
+
+/// Creates an arena that maps `chunk_size` bytes at a time, `0` for
+/// `ARENA_CHUNK_SIZE`
+///
+/// If `gc_roots` is set, every collection scans what has been allocated from
+/// the arena, so that the blocks it points to stay alive
+///
+/// Returns `NULL` if the first chunk could not be mapped
+Arena* arena_create(size_t chunk_size, bool gc_roots);
+
+/// Guarantees that the returned memory will be zeroed and aligned to
+/// `ALIGNMENT`
+///
+/// Returns `NULL` if a new chunk was needed and could not be mapped, which
+/// sizes close to `SIZE_MAX` never can
+void* arena_alloc(Arena* arena, size_t size);
+
+/// Frees everything allocated from the arena at once, keeping its chunks
+void arena_reset(Arena* arena);
+
+/// Unmaps the arena and every chunk it has
+void arena_destroy(Arena* arena);
+
+// Calls `visit` with everything allocated from the arena since its last reset
+void arena_visit_roots(Arena* arena, void (*visit)(uintptr_t* buf, size_t size));
+
+#endif
@@ -0,0 +1,93 @@
+// Measures how allocation throughput scales with the number of threads
+//
+// Every thread allocates and frees small blocks out of a fixed window, which is
+// the path the thread caches serve without taking the allocator's lock. The
+// same workload is run against the system's `malloc` for comparison.
+#include "../alloc.h"
+#include "../gc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPERATIONS 2000000
+#define WINDOW 64
+#define MAX_THREADS 64
+
+typedef struct {
+    void* (*alloc)(uint32_t);
+    void (*dealloc)(void*);
+} Api;
+
+void* malloc_alloc(uint32_t size) { return calloc(1, size); }
+
+volatile uintptr_t sink;
+
+void* worker(void* arg) {
+    Api* api = arg;
+    void* window[WINDOW] = {0};
+    unsigned int seed = (uintptr_t)pthread_self();
+
+    for (int i = 0; i < OPERATIONS; i++) {
+        int slot = i % WINDOW;
+        if (window[slot] != NULL)
+            api->dealloc(window[slot]);
+
+        window[slot] = api->alloc(16 + rand_r(&seed) % 240);
+        sink += (uintptr_t)window[slot];
+    }
+
+    for (int slot = 0; slot < WINDOW; slot++)
+        api->dealloc(window[slot]);
+
+    return NULL;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// Returns millions of operations (an allocation and a free) per second
+double run(Api* api, int thread_count) {
+    pthread_t threads[MAX_THREADS];
+
+    double start = now();
+    for (int i = 0; i < thread_count; i++)
+        pthread_create(&threads[i], NULL, worker, api);
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+
+    return (double)OPERATIONS * thread_count / elapsed / 1e6;
+}
+
+int main() {
+    // Collections stay out of the measurement, the heap grows instead
+    gc_disable();
+
+    Api nar = {allocate, deallocate};
+    Api libc = {malloc_alloc, free};
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("threads,narsirabad_mops,malloc_mops,narsirabad_speedup\n");
+
+    double single = 0;
+    for (int threads = 1; threads <= MAX_THREADS && threads <= cores * 2;
+         threads *= 2) {
+        double nar_mops = run(&nar, threads);
+        double libc_mops = run(&libc, threads);
+
+        if (threads == 1)
+            single = nar_mops;
+
+        printf("%d,%.2f,%.2f,%.2f\n", threads, nar_mops, libc_mops,
+               nar_mops / single);
+    }
+
+    gc_enable();
+}
@@ -0,0 +1,493 @@
+// Runs the standard allocator workloads against the heap and the system's
+// `malloc`, one CSV row per workload and allocator
+//
+// Every run happens in a freshly exec'd process of its own, so that its peak
+// RSS is its alone. Allocation latencies are sampled every `SAMPLE_EVERY`
+// allocations.
+//
+// `./suite [workload]` runs every workload, or only the one named
+#include "../alloc.h"
+#include "../gc.h"
+#include "../stats.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 32
+#define SAMPLE_EVERY 16
+#define MAX_SAMPLES (1 << 18)
+
+#define CHURN_OPS 2000000
+#define CHURN_WINDOW 256
+
+#define PRODUCER_ITEMS 500000
+#define RING_SIZE 1024
+
+#define LARSON_SLOTS 1000
+#define LARSON_OPS 250000
+#define LARSON_GENERATIONS 4
+
+#define LIST_LENGTH 10000
+#define LIST_ROUNDS 100
+#define TREE_DEPTH 12
+#define TREE_ROUNDS 20
+#define LONG_LIVED_DEPTH 14
+
+#define FRAGMENT_BLOCKS 8000
+#define FRAGMENT_ROUNDS 10
+
+typedef struct {
+    const char* name;
+    void* (*alloc)(uint32_t);
+    void (*dealloc)(void*);
+    // Whether garbage can be dropped instead of freed
+    bool collected;
+} Api;
+
+// The producer and consumer ends are a cache line apart, padded rather than
+// aligned since `Shared` comes from `Api.alloc`, which takes no alignment
+typedef struct {
+    void* slots[RING_SIZE];
+    uint64_t head;
+    uint8_t padding[56];
+    uint64_t tail;
+} Ring;
+
+// Blocks on their way between threads, or that outlive them
+//
+// Allocated from the allocator being measured and pointed to from the main
+// thread's stack, so the collector sees everything in here
+typedef struct {
+    Ring rings[MAX_THREADS / 2];
+    void* larson_slots[MAX_THREADS][LARSON_SLOTS];
+    void* fragment_blocks[FRAGMENT_BLOCKS];
+} Shared;
+
+typedef struct {
+    Api* api;
+    Shared* shared;
+    int id;
+    int thread_count;
+    unsigned int seed;
+    uint64_t ops;
+    uint64_t* samples;
+    size_t sample_count;
+} Worker;
+
+// What a child process hands back, in memory shared with the parent
+typedef struct {
+    double seconds;
+    uint64_t ops;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+    uint64_t collections;
+    uint64_t max_pause;
+    uint64_t total_pause;
+} Result;
+
+volatile uintptr_t sink;
+
+void* malloc_alloc(uint32_t size) { return calloc(1, size); }
+
+uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void* timed_alloc(Worker* w, uint32_t size) {
+    if (w->ops++ % SAMPLE_EVERY != 0)
+        return w->api->alloc(size);
+
+    uint64_t start = clock_ns();
+    void* ptr = w->api->alloc(size);
+    uint64_t latency = clock_ns() - start;
+
+    if (w->sample_count < MAX_SAMPLES / MAX_THREADS)
+        w->samples[w->sample_count++] = latency;
+
+    return ptr;
+}
+
+/// Sizes spread evenly over the powers of two from 16 bytes to 64 KiB
+uint32_t mixed_size(unsigned int* seed) {
+    uint32_t shift = rand_r(seed) % 12;
+    return 16 + rand_r(seed) % (16u << shift);
+}
+
+// Workloads
+
+/// Small blocks allocated and freed out of a window
+void churn(Worker* w) {
+    void* window[CHURN_WINDOW] = {0};
+
+    for (int i = 0; i < CHURN_OPS / w->thread_count; i++) {
+        int slot = rand_r(&w->seed) % CHURN_WINDOW;
+        w->api->dealloc(window[slot]);
+
+        window[slot] = timed_alloc(w, 16 + rand_r(&w->seed) % 240);
+        sink += (uintptr_t)window[slot];
+    }
+
+    for (int slot = 0; slot < CHURN_WINDOW; slot++)
+        w->api->dealloc(window[slot]);
+}
+
+/// Pairs of threads, one allocating and the other freeing everything the
+/// first one allocated
+void producer_consumer(Worker* w) {
+    Ring* ring = &w->shared->rings[w->id / 2];
+    int items = PRODUCER_ITEMS / (w->thread_count / 2);
+
+    for (int i = 0; i < items; i++) {
+        if (w->id % 2 == 0) {
+            uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+            while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+                   RING_SIZE)
+                sched_yield();
+
+            uint8_t* ptr = timed_alloc(w, 16 + rand_r(&w->seed) % 496);
+            ptr[0] = i;
+            ring->slots[tail % RING_SIZE] = ptr;
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        } else {
+            uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+            while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+                sched_yield();
+
+            void* ptr = ring->slots[head % RING_SIZE];
+            ring->slots[head % RING_SIZE] = NULL;
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+            w->api->dealloc(ptr);
+        }
+    }
+}
+
+/// Random replacement in a set of slots that outlives the thread, every
+/// generation of threads frees what the last one allocated
+void larson(Worker* w) {
+    void** slots = w->shared->larson_slots[w->id];
+
+    for (int i = 0; i < LARSON_OPS / w->thread_count; i++) {
+        int slot = rand_r(&w->seed) % LARSON_SLOTS;
+        w->api->dealloc(slots[slot]);
+        slots[slot] = timed_alloc(w, 16 + rand_r(&w->seed) % 1008);
+    }
+}
+
+typedef struct ListNode {
+    struct ListNode* next;
+    uint64_t value;
+} ListNode;
+
+/// Lists built and then dropped whole
+void gc_list(Worker* w) {
+    for (int round = 0; round < LIST_ROUNDS / w->thread_count; round++) {
+        ListNode* head = NULL;
+        for (int i = 0; i < LIST_LENGTH; i++) {
+            ListNode* node = timed_alloc(w, sizeof(ListNode));
+            node->next = head;
+            node->value = i;
+            head = node;
+        }
+
+        uint64_t sum = 0;
+        for (ListNode* node = head; node != NULL; node = node->next)
+            sum += node->value;
+        sink += sum;
+
+        if (!w->api->collected) {
+            while (head != NULL) {
+                ListNode* next = head->next;
+                w->api->dealloc(head);
+                head = next;
+            }
+        }
+    }
+}
+
+typedef struct TreeNode {
+    struct TreeNode* left;
+    struct TreeNode* right;
+} TreeNode;
+
+TreeNode* build_tree(Worker* w, int depth) {
+    TreeNode* node = timed_alloc(w, sizeof(TreeNode));
+    if (depth > 0) {
+        node->left = build_tree(w, depth - 1);
+        node->right = build_tree(w, depth - 1);
+    }
+
+    return node;
+}
+
+uint64_t count_tree(TreeNode* node) {
+    if (node == NULL)
+        return 0;
+
+    return 1 + count_tree(node->left) + count_tree(node->right);
+}
+
+void free_tree(Api* api, TreeNode* node) {
+    if (node == NULL)
+        return;
+
+    free_tree(api, node->left);
+    free_tree(api, node->right);
+    api->dealloc(node);
+}
+
+/// Short-lived trees next to a long-lived one, which every collection has to
+/// trace
+void gc_tree(Worker* w) {
+    TreeNode* long_lived = build_tree(w, LONG_LIVED_DEPTH);
+
+    for (int round = 0; round < TREE_ROUNDS / w->thread_count; round++) {
+        TreeNode* tree = build_tree(w, TREE_DEPTH);
+        sink += count_tree(tree);
+
+        if (!w->api->collected)
+            free_tree(w->api, tree);
+    }
+
+    sink += count_tree(long_lived);
+    if (!w->api->collected)
+        free_tree(w->api, long_lived);
+}
+
+/// Mixed sizes, most of them freed in a random order while the rest stay
+/// alive, so that later and larger blocks have to fit into the holes
+void fragmentation(Worker* w) {
+    void** blocks = w->shared->fragment_blocks;
+
+    for (int round = 0; round < FRAGMENT_ROUNDS; round++) {
+        for (int i = 0; i < FRAGMENT_BLOCKS; i++) {
+            if (blocks[i] == NULL)
+                blocks[i] = timed_alloc(w, mixed_size(&w->seed) + round * 64);
+        }
+
+        for (int i = 0; i < FRAGMENT_BLOCKS; i++) {
+            if (rand_r(&w->seed) % 4 != 0) {
+                w->api->dealloc(blocks[i]);
+                blocks[i] = NULL;
+            }
+        }
+    }
+
+    for (int i = 0; i < FRAGMENT_BLOCKS; i++)
+        w->api->dealloc(blocks[i]);
+}
+
+typedef struct {
+    const char* name;
+    void (*run)(Worker*);
+    // Whether it runs on every core, or on one thread
+    bool threaded;
+    // How many times the threads are started over
+    int generations;
+} Workload;
+
+Workload workloads[] = {
+    {"churn", churn, true, 1},
+    {"producer_consumer", producer_consumer, true, 1},
+    {"larson", larson, true, LARSON_GENERATIONS},
+    {"gc_list", gc_list, true, 1},
+    {"gc_tree", gc_tree, true, 1},
+    {"fragmentation", fragmentation, false, 1},
+};
+
+typedef struct {
+    Worker* worker;
+    Workload* workload;
+} Job;
+
+void* job_main(void* arg) {
+    Job* job = arg;
+
+    // Consumers hold on to blocks before they first call into the heap
+    if (job->worker->api->collected)
+        gc_register_thread();
+
+    job->workload->run(job->worker);
+    return NULL;
+}
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/// Runs a workload in the calling process, filling in everything but the
+/// peak RSS
+void run_workload(Workload* workload, Api* api, int thread_count,
+                  Result* result) {
+    Worker workers[MAX_THREADS];
+    Job jobs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+
+    Shared* shared = api->alloc(sizeof(Shared));
+
+    // Taken before the clock starts, from the system so both sides pay alike
+    for (int i = 0; i < thread_count; i++) {
+        workers[i] = (Worker){api, shared, i, thread_count, i + 1, 0, NULL, 0};
+        workers[i].samples =
+            malloc(MAX_SAMPLES / MAX_THREADS * sizeof(uint64_t));
+        jobs[i] = (Job){&workers[i], workload};
+    }
+
+    uint64_t start = clock_ns();
+    for (int generation = 0; generation < workload->generations; generation++) {
+        for (int i = 0; i < thread_count; i++)
+            pthread_create(&threads[i], NULL, job_main, &jobs[i]);
+        for (int i = 0; i < thread_count; i++)
+            pthread_join(threads[i], NULL);
+    }
+    result->seconds = (clock_ns() - start) / 1e9;
+
+    uint64_t* samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    size_t count = 0;
+    result->ops = 0;
+    for (int i = 0; i < thread_count; i++) {
+        memcpy(samples + count, workers[i].samples,
+               workers[i].sample_count * sizeof(uint64_t));
+        count += workers[i].sample_count;
+        result->ops += workers[i].ops;
+        free(workers[i].samples);
+    }
+
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    if (count > 0) {
+        result->p50 = samples[count / 2];
+        result->p99 = samples[count * 99 / 100];
+        result->p999 = samples[count * 999 / 1000];
+        result->max = samples[count - 1];
+    }
+    free(samples);
+
+    if (api->collected) {
+        NarStats stats = nar_stats();
+        result->collections = stats.collections;
+        result->max_pause = stats.max_pause;
+        result->total_pause = stats.total_pause;
+    }
+}
+
+/*
+ * Runs `workload` on `api` in a process of its own, which writes its `Result`
+ * into a pipe. The child is exec'd afresh rather than just forked, so that it
+ * starts from an empty heap.
+ */
+void spawn_run(char* self, Workload* workload, Api* api, int threads,
+               Result* result, struct rusage* usage) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        printf("Failed to create a pipe\n");
+        exit(1);
+    }
+
+    char thread_arg[16];
+    snprintf(thread_arg, sizeof(thread_arg), "%d", threads);
+
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        char* args[] = {self, "--run", (char*)workload->name, (char*)api->name,
+                        thread_arg, NULL};
+        execv("/proc/self/exe", args);
+        _exit(1);
+    }
+    close(fds[1]);
+
+    memset(result, 0, sizeof(Result));
+    size_t got = 0;
+    while (child != -1 && got < sizeof(Result)) {
+        ssize_t n = read(fds[0], (char*)result + got, sizeof(Result) - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fds[0]);
+
+    int status;
+    if (child == -1 || wait4(child, &status, 0, usage) == -1 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        got != sizeof(Result)) {
+        printf("Failed to run %s on %s\n", workload->name, api->name);
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    Api apis[] = {
+        {"narsirabad", allocate, deallocate, true},
+        {"malloc", malloc_alloc, free, false},
+    };
+    size_t workload_count = sizeof(workloads) / sizeof(Workload);
+    size_t api_count = sizeof(apis) / sizeof(Api);
+
+    // `--run <workload> <allocator> <threads>`, from `spawn_run`
+    if (argc == 5 && strcmp(argv[1], "--run") == 0) {
+        for (size_t i = 0; i < workload_count; i++) {
+            for (size_t j = 0; j < api_count; j++) {
+                if (strcmp(argv[2], workloads[i].name) != 0 ||
+                    strcmp(argv[3], apis[j].name) != 0)
+                    continue;
+
+                Result result = {0};
+                run_workload(&workloads[i], &apis[j], atoi(argv[4]), &result);
+                if (write(STDOUT_FILENO, &result, sizeof(Result)) !=
+                    sizeof(Result))
+                    return 1;
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    // Producers and consumers come in pairs
+    int thread_count = cores < 2             ? 2
+                       : cores > MAX_THREADS ? MAX_THREADS
+                                             : cores;
+    thread_count &= ~1;
+
+    printf("workload,allocator,threads,ops,seconds,mops,alloc_p50_ns,"
+           "alloc_p99_ns,alloc_p999_ns,alloc_max_ns,peak_rss_kb,collections,"
+           "gc_max_pause_ns,gc_total_pause_ns\n");
+    fflush(stdout);
+
+    for (size_t i = 0; i < workload_count; i++) {
+        Workload* workload = &workloads[i];
+        if (argc > 1 && strcmp(argv[1], workload->name) != 0)
+            continue;
+
+        int threads = workload->threaded ? thread_count : 1;
+
+        for (size_t j = 0; j < api_count; j++) {
+            Result result;
+            struct rusage usage;
+            spawn_run(argv[0], workload, &apis[j], threads, &result, &usage);
+
+            printf("%s,%s,%d,%lu,%.3f,%.2f,%lu,%lu,%lu,%lu,%ld,%lu,%lu,%lu\n",
+                   workload->name, apis[j].name, threads, result.ops,
+                   result.seconds, result.ops / result.seconds / 1e6,
+                   result.p50, result.p99, result.p999, result.max,
+                   usage.ru_maxrss, result.collections, result.max_pause,
+                   result.total_pause);
+            fflush(stdout);
+        }
+    }
+}
@@ -17,6 +17,7 @@ BlockList BL_new() {
     list.arr = mapping;
     list.len = 0;
     list.cap = page_size / sizeof(Block);
+    list.vacant = BLOCK_NONE;
 
     return list;
 }
@@ -41,20 +42,6 @@ Block* BL_idx(BlockList* list, size_t idx) {
     return &list->arr[idx];
 }
 
-void BL_remove(BlockList* list, size_t idx) {
-    if (list->len <= idx) {
-        return;
-    }
-
-    Block* clear_address = list->arr + idx;
-    size_t remaining_bytes = (list->len - idx - 1) * sizeof(Block);
-
-    memset(clear_address, 0, sizeof(Block));
-    memmove(clear_address, clear_address + 1, remaining_bytes);
-
-    list->len--;
-}
-
 void BL_free(BlockList* list) {
     int8_t unmap_result = munmap(list->arr, list->cap * sizeof(Block));
     if (unmap_result == -1) {
@@ -69,17 +56,49 @@ void BL_free(BlockList* list) {
 // TODO
 // This function exists because otherwise we'd have to create a `Block`
 // then pass it into the push function, which is slow
+//
+// Vacant headers are reused before the list grows
 size_t BL_new_header(BlockList* list, size_t size, void* ptr) {
-    if (list->len == list->cap) {
-        BL_realloc(list);
+    size_t idx = list->vacant;
+    if (idx != BLOCK_NONE) {
+        list->vacant = list->arr[idx].next_free;
+    } else {
+        if (list->len == list->cap) {
+            BL_realloc(list);
+        }
+
+        idx = list->len++;
     }
 
-    Block* next_header = list->arr + list->len;
+    Block* next_header = list->arr + idx;
     next_header->size = size;
     next_header->ptr = ptr;
-    next_header->offset = 0;
+    next_header->flags = 0;
+    next_header->next_free = BLOCK_NONE;
+    next_header->prev_free = BLOCK_NONE;
+    next_header->prev_phys = BLOCK_NONE;
+    next_header->next_phys = BLOCK_NONE;
+
+    return idx;
+}
 
-    return list->len++;
+/*
+ * Marks the header at `idx` as vacant so that it can be handed out again by
+ * `BL_new_header`.
+ *
+ * The header is not moved, so the indices of every other header stay valid.
+ */
+void BL_drop_header(BlockList* list, size_t idx) {
+    Block* header = list->arr + idx;
+    header->ptr = NULL;
+    header->size = 0;
+    header->flags = 0;
+    header->next_free = list->vacant;
+    header->prev_free = BLOCK_NONE;
+    header->prev_phys = BLOCK_NONE;
+    header->next_phys = BLOCK_NONE;
+
+    list->vacant = idx;
 }
 
 void BL_push(BlockList* list, Block block) {
@@ -97,13 +116,3 @@ size_t BL_find(BlockList* list, Block* block) {
 
     return -1;
 }
-
-bool BL_find_remove(BlockList* list, Block* block) {
-    int idx = BL_find(list, block);
-    if (idx == -1)
-        return false;
-
-    BL_remove(list, idx);
-
-    return true;
-}
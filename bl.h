@@ -18,9 +18,7 @@ Block* BL_idx(BlockList* list, size_t idx);
 
 size_t BL_find(BlockList* list, Block* block);
 
-bool BL_find_remove(BlockList* list, Block* value);
-
-void BL_remove(BlockList* list, size_t idx);
+void BL_drop_header(BlockList* list, size_t idx);
 
 void BL_free(BlockList* list);
 
@@ -1,61 +1,258 @@
+#define _GNU_SOURCE
+
+#include "gc.h"
 #include "alloc.h"
+#include "arena.h"
 #include "bl.h"
+#include "mem.h"
+#include "pm.h"
+#include "stats.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
 
 #define NA NARSIRABAD_ALLOCATOR
+#define NC NARSIRABAD_COLLECTOR
 
 extern Allocator NARSIRABAD_ALLOCATOR;
 
-extern uintptr_t top_of_stack;
-extern uintptr_t bottom_of_stack;
+Collector NARSIRABAD_COLLECTOR;
 
-extern uintptr_t start_of_bss;
-extern uintptr_t end_of_bss;
+// The calling thread's entry in `NA.mutators`
+__thread Mutator mutator;
 
 /*
- * Finds the block corresponding with the given pointer (the pointer must
- * point to the beginning of the block)
- * Returns the index of the block in `NA.headers`, or `-1` if it could not
- * be found
+ * Finds the used block corresponding with the given pointer, which may point
+ * anywhere into the memory handed out for the block
+ * Returns the index of the block in `NA.headers`, or `BLOCK_NONE` if it could
+ * not be found
  */
-int8_t find_corresponding_block(void* ptr) {
-    for (int i = 0; i < NA.used_headers.len; i++) {
-        Block header = *BRL_idx(&NA.used_headers, i);
+uint32_t find_corresponding_block(void* ptr) {
+    uint32_t block_idx = PM_find(&NA.page_map, ptr);
+    if (block_idx >= NA.headers.len)
+        return BLOCK_NONE;
 
-        if ((uint8_t*)header.ptr + header.offset == ptr) {
-            return i;
-        }
+    // The tag we found might belong to a block that ends before `ptr`, or have
+    // been overwritten by its neighbour
+    Block* header = BL_idx(&NA.headers, block_idx);
+    if (header->ptr == NULL || is_free(header))
+        return BLOCK_NONE;
+
+    uint8_t* end = (uint8_t*)header->ptr + header->size;
+    if ((uint8_t*)ptr < (uint8_t*)block_data(header) || (uint8_t*)ptr >= end)
+        return BLOCK_NONE;
+
+    return block_idx;
+}
+
+/*
+ * Pushes a block onto the bottom of a worker's deque.
+ *
+ * If the deque is full, the block stays marked but is dropped, and
+ * `NC.overflowed` is set so `mark` knows to rescan the heap for it.
+ */
+void deque_push(MarkDeque* deque, uint32_t block_idx) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (bottom - top >= MARK_DEQUE_CAP) {
+        __atomic_store_n(&NC.overflowed, true, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_store_n(&deque->arr[bottom % MARK_DEQUE_CAP], block_idx,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pops a block off the bottom of the calling worker's own deque.
+ *
+ * Returns `BLOCK_NONE` once the deque is empty
+ */
+uint32_t deque_pop(MarkDeque* deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return BLOCK_NONE;
+    }
+
+    uint32_t block_idx = __atomic_load_n(&deque->arr[bottom % MARK_DEQUE_CAP],
+                                         __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // The last block, which a thief might be taking at the same time
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            block_idx = BLOCK_NONE;
+
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
     }
 
-    return -1;
+    return block_idx;
 }
 
 /*
- * Marks every block that holds a pointer to an allocation owned by `NA` as
- * used, if that pointer is found in the current buffer.
+ * Takes a block off the top of another worker's deque.
  *
- * For every pointer found this way, the function recurses on the buffer
- * that pointer points to, taking the `size` of this sub-buffer from the
- * header corresponding to the parent pointer (`header->size`).
+ * Returns `BLOCK_NONE` if the deque is empty or another worker got there first
+ */
+uint32_t deque_steal(MarkDeque* deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+        return BLOCK_NONE;
+
+    uint32_t block_idx =
+        __atomic_load_n(&deque->arr[top % MARK_DEQUE_CAP], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return BLOCK_NONE;
+
+    return block_idx;
+}
+
+bool deque_is_empty(MarkDeque* deque) {
+    return __atomic_load_n(&deque->top, __ATOMIC_RELAXED) >=
+           __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sets the mark bit of a block, any number of workers may race on it.
  *
- * The marking algorithm over a single buffer has time complexity:
- * O(`size` * `NA.header_len`)
+ * Returns whether this call was the one to mark the block
+ */
+bool set_mark(uint32_t block_idx) {
+    // Only blocks handed out during an incremental cycle can be past the end of
+    // the marks, and those are alive anyway
+    if (block_idx >= NC.marks_cap)
+        return false;
+
+    uint64_t bit = 1ull << (block_idx % 64);
+    uint64_t* word = &NC.marks[block_idx / 64];
+
+    // Most pointers lead to blocks that are already marked, which doesn't need
+    // the cache line to be taken exclusively
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+        return false;
+
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+bool is_marked(uint32_t block_idx) {
+    return block_idx < NC.marks_cap &&
+           NC.marks[block_idx / 64] & (1ull << (block_idx % 64));
+}
+
+/*
+ * Marks a block as used, queueing its contents to be scanned by `worker` if it
+ * wasn't marked already.
+ */
+void mark_block(MarkWorker* worker, uint32_t block_idx) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+    BlockTag* tag = (BlockTag*)block_data(header) - 1;
+
+    // A minor collection takes every old block to be alive, and finds the young
+    // blocks they point to through the dirty cards instead
+    if (NC.minor && !tag->young)
+        return;
+
+    if (!set_mark(block_idx))
+        return;
+
+    // Nothing in it to scan, so it never takes a slot in the deque
+    if (tag->atomic) {
+        worker->bytes_skipped += header->size - sizeof(BlockTag);
+        return;
+    }
+
+    deque_push(&worker->deque, block_idx);
+}
+
+/*
+ * Marks the pooled object `ptr` points into as used, queueing its slab to be
+ * scanned by `worker` if it isn't queued already.
+ *
+ * Slots that aren't handed out are ignored, so are all of them during a minor
+ * collection, which takes pooled objects to be old.
+ */
+void mark_slot(MarkWorker* worker, uint32_t block_idx, void* ptr) {
+    if (NC.minor)
+        return;
+
+    PoolSlab* slab = block_data(BL_idx(&NA.headers, block_idx));
+    if ((uint8_t*)ptr < slab->slots)
+        return;
+
+    size_t i = ((uint8_t*)ptr - slab->slots) / slab->pool->size;
+    if (i >= slab->count)
+        return;
+
+    uint64_t bit = 1ull << (i % 64);
+    if (!(__atomic_load_n(&slab->allocated[i / 64], __ATOMIC_RELAXED) & bit) ||
+        __atomic_load_n(&slab->marks[i / 64], __ATOMIC_RELAXED) & bit ||
+        __atomic_fetch_or(&slab->marks[i / 64], bit, __ATOMIC_RELAXED) & bit)
+        return;
+
+    // Marked as well, so a rescan gets to the slab
+    set_mark(block_idx);
+
+    if (!__atomic_exchange_n(&slab->queued, 1, __ATOMIC_SEQ_CST))
+        deque_push(&worker->deque, block_idx);
+}
+
+/*
+ * Marks the block or pooled object `ptr` points into as used, if it points
+ * into the heap at all.
+ */
+void mark_ptr(MarkWorker* worker, void* ptr) {
+    uint32_t block_idx = find_corresponding_block(ptr);
+    if (block_idx == BLOCK_NONE)
+        return;
+
+    if (BL_idx(&NA.headers, block_idx)->flags & BLOCK_POOL)
+        mark_slot(worker, block_idx, ptr);
+    else
+        mark_block(worker, block_idx);
+}
+
+/*
+ * Marks every block that a pointer found in the current buffer points into as
+ * used.
  *
- * This function has the potential to recure indefinitely at the moment if
- * a cyclical reference is encountered. It probably shouldn't though.
+ * The blocks found this way are only queued on the worker's deque, their own
+ * contents are scanned later by whichever worker gets to them. This keeps the
+ * C stack flat no matter how long a chain of pointers is, and the mark bits
+ * make cycles harmless.
  *
- * `used_blocks` - The array in which to store whether a block is alive.
- *     The indicies of the array should correspond to the indicies of the
- *     headers in `NA`
+ * The marking algorithm over a single buffer has time complexity:
+ * O(`size`), since every potential pointer is resolved through `NA.page_map`
+ *
+ * `worker` - The worker doing the scanning
  * `buf` - The buffer in which to search for pointers
  * `size` - The number of potential pointers in `buf`
  */
-void mark_used_blocks_by_ptrs_in_buffer(bool used_blocks[NA.used_headers.len],
-                                        uintptr_t* buf, size_t size) {
+void mark_used_blocks_by_ptrs_in_buffer(MarkWorker* worker, uintptr_t* buf,
+                                        size_t size) {
     // TODO
     // One problem we have here is that we don't know whether the buffer grows
     // up or down
@@ -69,129 +266,1466 @@ void mark_used_blocks_by_ptrs_in_buffer(bool used_blocks[NA.used_headers.len],
     // What if we encounted dangling pointers on old stack frames?
     // We might accidently have false negatives
 
-    for (int i = 0; i < size; i++) {
-        int8_t block_idx = find_corresponding_block((void*)buf[i]);
-        if (block_idx == -1)
-            continue;
+    for (size_t i = 0; i < size; i++)
+        mark_ptr(worker, (void*)buf[i]);
+}
 
-        if (used_blocks[block_idx])
-            continue;
+/*
+ * Scans only the words of a typed block that its layout says may hold
+ * pointers, among the words `from` up to `to` of its data. The layout repeats
+ * for as many objects as fit in the block.
+ */
+void scan_typed(MarkWorker* worker, uintptr_t* data, size_t from, size_t to,
+                uint16_t layout) {
+    Layout* type = &NC.layouts[layout];
+    size_t visited = 0;
+
+    for (size_t first = from - from % type->words; first < to;
+         first += type->words) {
+        for (uint32_t i = 0; i < (type->words + 63) / 64; i++) {
+            for (uint64_t bits = type->bits[i]; bits != 0; bits &= bits - 1) {
+                size_t word = first + i * 64 + __builtin_ctzll(bits);
+                if (word >= to)
+                    break;
+                if (word < from)
+                    continue;
+
+                mark_ptr(worker, (void*)data[word]);
+                visited++;
+            }
+        }
+    }
+
+    worker->bytes_scanned += visited * sizeof(uintptr_t);
+    worker->bytes_skipped += (to - from - visited) * sizeof(uintptr_t);
+}
+
+/*
+ * Scans every marked slot of a slab that no worker has scanned yet.
+ *
+ * The slab is unqueued first, so a slot marked while this runs either gets
+ * scanned here or queues the slab again.
+ */
+void scan_slab(MarkWorker* worker, PoolSlab* slab) {
+    __atomic_store_n(&slab->queued, 0, __ATOMIC_SEQ_CST);
+
+    size_t size = slab->pool->size;
+    for (uint32_t word = 0; word < (slab->count + 63) / 64; word++) {
+        uint64_t pending =
+            __atomic_load_n(&slab->marks[word], __ATOMIC_RELAXED) &
+            ~__atomic_load_n(&slab->scanned[word], __ATOMIC_RELAXED);
+
+        for (; pending != 0; pending &= pending - 1) {
+            uint64_t bit = pending & -pending;
+            if (__atomic_fetch_or(&slab->scanned[word], bit, __ATOMIC_RELAXED) &
+                bit)
+                continue;
+
+            uint8_t* slot = slab->slots + (word * 64 + __builtin_ctzll(bit)) * size;
+            worker->bytes_scanned += size;
+            mark_used_blocks_by_ptrs_in_buffer(worker, (uintptr_t*)slot,
+                                               size / sizeof(uintptr_t));
+        }
+    }
+}
+
+/*
+ * Scans the contents of a marked block for pointers.
+ */
+void scan_block(MarkWorker* worker, uint32_t block_idx) {
+    Block* header = BL_idx(&NA.headers, block_idx);
+
+    // Dropped since it was queued, like the slabs of a destroyed pool
+    if (header->ptr == NULL)
+        return;
+
+    if (header->flags & BLOCK_POOL) {
+        scan_slab(worker, block_data(header));
+        return;
+    }
 
-        Block header = *BRL_idx(&NA.used_headers, block_idx);
-        mark_used_blocks_by_ptrs_in_buffer(used_blocks, header.ptr,
-                                           header.size);
+    // Only reached while rescanning, `mark_block` never queues these
+    BlockTag* tag = (BlockTag*)block_data(header) - 1;
+    if (tag->atomic)
+        return;
 
-        used_blocks[block_idx] = true;
+    size_t data_size = header->size - sizeof(BlockTag);
+    if (tag->layout != 0) {
+        scan_typed(worker, block_data(header), 0,
+                   data_size / sizeof(uintptr_t), tag->layout);
+        return;
     }
+
+    worker->bytes_scanned += data_size;
+
+    mark_used_blocks_by_ptrs_in_buffer(worker, block_data(header),
+                                       data_size / sizeof(uintptr_t));
+}
+
+/*
+ * Scans blocks off the worker's own deque until it's empty.
+ */
+void drain_deque(MarkWorker* worker) {
+    uint32_t block_idx;
+    while ((block_idx = deque_pop(&worker->deque)) != BLOCK_NONE)
+        scan_block(worker, block_idx);
 }
 
-void mark_stack(bool used_blocks[NA.used_headers.len]) {
-    // Align `top_of_stack` to `8`
-    uintptr_t diff = (uintptr_t)top_of_stack % 8;
-    if (diff != 0) {
-        top_of_stack += 8 - diff;
+/*
+ * Scans one block stolen from another worker, starting the search at a
+ * different worker every time so thieves spread out.
+ *
+ * Returns whether anything was stolen
+ */
+bool steal_block(MarkWorker* worker) {
+    worker->seed = worker->seed * 1103515245 + 12345;
+    uint32_t first = (worker->seed >> 16) % NC.worker_count;
+
+    for (uint32_t i = 0; i < NC.worker_count; i++) {
+        MarkWorker* victim = &NC.workers[(first + i) % NC.worker_count];
+        if (victim == worker)
+            continue;
+
+        uint32_t block_idx = deque_steal(&victim->deque);
+        if (block_idx != BLOCK_NONE) {
+            scan_block(worker, block_idx);
+            return true;
+        }
     }
 
-    // Yes, this is correct
-    assert(top_of_stack < bottom_of_stack);
+    return false;
+}
+
+bool any_work_left() {
+    for (uint32_t i = 0; i < NC.worker_count; i++) {
+        if (!deque_is_empty(&NC.workers[i].deque))
+            return true;
+    }
 
-    /// The number of pointers that can exist in the current buffer
-    /// Rounded down because the top the the stack might not be aligned to
-    /// `8`, but the bottom will be
-    size_t stack_size = ((uintptr_t)bottom_of_stack - (uintptr_t)top_of_stack) /
-                        sizeof(uintptr_t);
-    mark_used_blocks_by_ptrs_in_buffer(used_blocks, (uintptr_t*)top_of_stack,
-                                       stack_size);
+    return false;
 }
 
-// TODO
-// Implement searching and marking through other sections
-void mark_bss(bool used_blocks[NA.used_headers.len]) {
-    // NOTE
-    // No need to align the bottom of the bss
-    // I think?
+/*
+ * Scans a chunk of roots claimed from `NC.roots`, or while rescanning, every
+ * marked block in a chunk of `NA.headers`.
+ */
+void scan_roots(MarkWorker* worker, size_t chunk) {
+    if (!NC.rescanning) {
+        RootRange* range = &NC.roots.arr[chunk];
+        mark_used_blocks_by_ptrs_in_buffer(worker, range->buf, range->size);
+        return;
+    }
 
-    // TODO Verify that this is correct
-    assert(start_of_bss > end_of_bss);
+    uint32_t end = (chunk + 1) * RESCAN_CHUNK;
+    if (end > NA.headers.len)
+        end = NA.headers.len;
 
-    // printf("Start of .BSS: %po\n  End of .BSS: %po\n\n", (void*)start_of_bss,
-    //        (void*)end_of_bss);
+    for (uint32_t i = chunk * RESCAN_CHUNK; i < end; i++) {
+        if (is_marked(i))
+            scan_block(worker, i);
 
-    size_t stack_size = start_of_bss - end_of_bss;
-    mark_used_blocks_by_ptrs_in_buffer(used_blocks, (uintptr_t*)end_of_bss,
-                                       stack_size);
+        drain_deque(worker);
+    }
 }
 
 /*
- * Loops through the registers the system will likely be using, marking all the
- pointers found in both those registers and the `NARSIRABAD_ALLOCATOR`
+ * The part of a mark phase every worker runs: claims chunks of roots until
+ * there are none left, then keeps scanning its own blocks and stealing those of
+ * others until every worker has run out.
  *
- * List of registers:
- * https://cs.brown.edu/courses/cs033/docs/guides/x64_cheatsheet.pdf
+ * A worker only goes idle with an empty deque, and only active workers push, so
+ * once `NC.active` hits `0` every deque is empty for good.
+ */
+void mark_worker(MarkWorker* worker) {
+    size_t chunk_count = NC.rescanning
+                             ? (NA.headers.len + RESCAN_CHUNK - 1) / RESCAN_CHUNK
+                             : NC.roots.len;
+
+    for (;;) {
+        size_t chunk = __atomic_fetch_add(&NC.next_root, 1, __ATOMIC_RELAXED);
+        if (chunk >= chunk_count)
+            break;
+
+        scan_roots(worker, chunk);
+        drain_deque(worker);
+    }
+
+    for (;;) {
+        drain_deque(worker);
+        if (steal_block(worker))
+            continue;
+
+        __atomic_fetch_sub(&NC.active, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&NC.active, __ATOMIC_SEQ_CST) == 0)
+                return;
+
+            if (any_work_left()) {
+                __atomic_fetch_add(&NC.active, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+
+            sched_yield();
+        }
+    }
+}
+
+void* helper_main(void* arg) {
+    MarkWorker* worker = arg;
+    uint64_t seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&NC.workers_lock);
+        while (NC.phase == seen)
+            pthread_cond_wait(&NC.phase_started, &NC.workers_lock);
+        seen = NC.phase;
+        pthread_mutex_unlock(&NC.workers_lock);
+
+        mark_worker(worker);
+
+        pthread_mutex_lock(&NC.workers_lock);
+        NC.finished++;
+        pthread_cond_signal(&NC.phase_finished);
+        pthread_mutex_unlock(&NC.workers_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Maps every worker's deque and starts the helper threads, one less than there
+ * are cores, up to `GC_MAX_WORKERS` workers in total.
  *
+ * This has to happen before the world is stopped, a stopped thread might be
+ * holding locks `pthread_create` needs
+ */
+void start_workers() {
+    if (NC.workers_started)
+        return;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    NC.worker_count = cores < 1 ? 1 : cores > GC_MAX_WORKERS ? GC_MAX_WORKERS
+                                                            : cores;
+
+    for (uint32_t i = 0; i < NC.worker_count; i++) {
+        NC.workers[i].deque.arr = map_new(MARK_DEQUE_CAP * sizeof(uint32_t));
+        if (NC.workers[i].deque.arr == MAP_FAILED) {
+            printf("Failed to map a mark deque\n");
+            exit(1);
+        }
+        NC.workers[i].seed = i + 1;
+    }
+
+    // Helpers must never run the program's signal handlers
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for (uint32_t i = 1; i < NC.worker_count; i++) {
+        if (pthread_create(&NC.workers[i].thread, NULL, helper_main,
+                           &NC.workers[i]) != 0) {
+            // Mark with however many helpers we got
+            NC.worker_count = i;
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    NC.workers_started = true;
+}
+
+/*
+ * Runs one mark phase across every worker, returning once they are all done.
+ */
+void run_mark_phase() {
+    NC.next_root = 0;
+    NC.active = NC.worker_count;
+
+    pthread_mutex_lock(&NC.workers_lock);
+    NC.finished = 0;
+    NC.phase++;
+    pthread_cond_broadcast(&NC.phase_started);
+    pthread_mutex_unlock(&NC.workers_lock);
+
+    mark_worker(&NC.workers[0]);
+
+    pthread_mutex_lock(&NC.workers_lock);
+    while (NC.finished < NC.worker_count - 1)
+        pthread_cond_wait(&NC.phase_finished, &NC.workers_lock);
+    pthread_mutex_unlock(&NC.workers_lock);
+}
+
+/*
+ * Adds a buffer to the roots, split into chunks of `ROOT_CHUNK` words so they
+ * spread evenly over the workers.
+ */
+void add_roots(uintptr_t* buf, size_t size) {
+    RootList* roots = &NC.roots;
+
+    for (size_t i = 0; i < size; i += ROOT_CHUNK) {
+        if (roots->len == roots->cap) {
+            size_t new_cap = roots->cap * 2;
+            RootRange* new_mapping = map_new(new_cap * sizeof(RootRange));
+            if (new_mapping == MAP_FAILED)
+                exit(1);
+
+            memcpy(new_mapping, roots->arr, roots->len * sizeof(RootRange));
+            munmap(roots->arr, roots->cap * sizeof(RootRange));
+
+            roots->arr = new_mapping;
+            roots->cap = new_cap;
+        }
+
+        size_t chunk = size - i < ROOT_CHUNK ? size - i : ROOT_CHUNK;
+        roots->arr[roots->len++] = (RootRange){buf + i, chunk};
+    }
+}
+
+/*
+ * Makes sure there is a mark bit for every header and clears them all.
  *
- * We are not checking the following registers:
- * - `rsp`: Stack Pointer
- * - `rbp`: Stack Frame Base Pointer
+ * The deques, roots and mark bits are kept between collections, so that a
+ * collection doesn't have to map anything in the common case.
+ */
+void prepare_marks() {
+    size_t page_size = getpagesize();
+
+    if (NC.roots.arr == NULL) {
+        NC.roots.arr = map_new(page_size);
+        if (NC.roots.arr == MAP_FAILED)
+            exit(1);
+
+        NC.roots.cap = page_size / sizeof(RootRange);
+    }
+    NC.roots.len = 0;
+    NC.overflowed = false;
+
+    if (NC.marks_cap < NA.headers.len) {
+        if (NC.marks != NULL)
+            munmap(NC.marks, NC.marks_cap / 8);
+
+        size_t bytes = (NA.headers.cap / 8 + page_size - 1) & ~(page_size - 1);
+        NC.marks = map_new(bytes);
+        if (NC.marks == MAP_FAILED)
+            exit(1);
+
+        NC.marks_cap = bytes * 8;
+    }
+
+    memset(NC.marks, 0, (NA.headers.len + 63) / 64 * sizeof(uint64_t));
+
+    for (Pool* pool = NA.pools; pool != NULL; pool = pool->next) {
+        size_t words = (pool->count + 63) / 64;
+
+        for (PoolSlab* slab = pool->slabs; slab != NULL; slab = slab->next) {
+            memset(slab->marks, 0, words * sizeof(uint64_t));
+            memset(slab->scanned, 0, words * sizeof(uint64_t));
+            slab->queued = 0;
+        }
+    }
+}
+
+/*
+ * Adds the stack and registers of every registered thread to the roots.
  *
- * This has to be a macro, because the assembly code has to be generated at
- * compile time.
+ * Every thread but the collecting one is stopped, and has recorded where its
+ * stack ended and what its registers held when it stopped.
+ */
+void add_stacks() {
+    for (Mutator* m = NA.mutators; m != NULL; m = m->next) {
+        // Align the top of the stack to `8`
+        uintptr_t top = (m->top_of_stack + 7) & ~(uintptr_t)7;
+
+        // A thread stopped on an alternate signal stack has only its
+        // registers to go on
+        if (top < m->bottom_of_stack) {
+            /// Rounded down because the top the the stack might not be aligned
+            /// to `8`, but the bottom will be
+            size_t stack_size =
+                (m->bottom_of_stack - top) / sizeof(uintptr_t);
+            add_roots((uintptr_t*)top, stack_size);
+        }
+
+        add_roots((uintptr_t*)&m->registers,
+                  sizeof(mcontext_t) / sizeof(uintptr_t));
+    }
+}
+
+/*
+ * Adds everything allocated from the arenas registered as roots.
+ */
+void add_arenas() {
+    for (Arena* arena = NA.arenas; arena != NULL; arena = arena->next)
+        arena_visit_roots(arena, add_roots);
+}
+
+/*
+ * Appends the words from `start` up to `end` to `NC.ranges`, the caller holds
+ * `NA.lock`.
  */
-void mark_registers(bool used_blocks[NA.used_headers.len]) {
+void push_range(uintptr_t* start, uintptr_t* end) {
+    RootList* ranges = &NC.ranges;
 
-// TODO
-// Maybe move this to the top of the file
-#define CHECK_REG(r)                                                           \
-    {                                                                          \
-        register register_t v asm(#r);                                         \
-        int8_t block_number = find_corresponding_block((void*)v);              \
-        if (block_number != -1) {                                              \
-            used_blocks[block_number] = true;                                  \
-        }                                                                      \
+    if (ranges->len == ranges->cap) {
+        size_t new_cap = ranges->cap == 0 ? getpagesize() / sizeof(RootRange)
+                                          : ranges->cap * 2;
+        RootRange* new_mapping = map_new(new_cap * sizeof(RootRange));
+        if (new_mapping == MAP_FAILED)
+            exit(1);
+
+        if (ranges->arr != NULL) {
+            memcpy(new_mapping, ranges->arr, ranges->len * sizeof(RootRange));
+            munmap(ranges->arr, ranges->cap * sizeof(RootRange));
+        }
+
+        ranges->arr = new_mapping;
+        ranges->cap = new_cap;
     }
 
-    CHECK_REG(rax)
-    CHECK_REG(rcx)
-    CHECK_REG(rsi)
-    CHECK_REG(rdi)
-    CHECK_REG(r8)
-    CHECK_REG(r9)
-    CHECK_REG(r10)
-    CHECK_REG(r11)
-    CHECK_REG(r12)
-    CHECK_REG(r13)
-    CHECK_REG(r14)
-    CHECK_REG(r15)
+    ranges->arr[ranges->len++] = (RootRange){start, end - start};
+}
+
+void gc_add_roots(void* start, void* end) {
+    // Only whole words are scanned
+    uintptr_t from = ((uintptr_t)start + 7) & ~(uintptr_t)7;
+    uintptr_t to = (uintptr_t)end & ~(uintptr_t)7;
+    if (to <= from)
+        return;
+
+    pthread_mutex_lock(&NA.lock);
+    push_range((uintptr_t*)from, (uintptr_t*)to);
+    pthread_mutex_unlock(&NA.lock);
 }
 
-void sweep(bool used_blocks[NA.used_headers.len]) {
-    for (int i = 0; i < NA.used_headers.len; i++) {
-        if (used_blocks[i])
+void gc_remove_roots(void* start, void* end) {
+    // Every word that overlaps is dropped
+    uintptr_t* from = (uintptr_t*)((uintptr_t)start & ~(uintptr_t)7);
+    uintptr_t* to = (uintptr_t*)(((uintptr_t)end + 7) & ~(uintptr_t)7);
+
+    pthread_mutex_lock(&NA.lock);
+
+    // Ranges that are cut in two keep the front where they are and have the
+    // back appended, which is past `len` and so not looked at again
+    size_t len = NC.ranges.len;
+    for (size_t i = 0; i < len; i++) {
+        uintptr_t* range_start = NC.ranges.arr[i].buf;
+        uintptr_t* range_end = range_start + NC.ranges.arr[i].size;
+        if (to <= range_start || from >= range_end)
             continue;
 
-        // Equivalent to `free_block(header)`
-        Block* header = BRL_idx(&NA.used_headers, i);
+        if (to < range_end)
+            push_range(to, range_end);
 
-        header->size += header->offset;
-        header->offset = 0;
+        NC.ranges.arr[i].size = from > range_start ? from - range_start : 0;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < NC.ranges.len; i++)
+        if (NC.ranges.arr[i].size != 0)
+            NC.ranges.arr[kept++] = NC.ranges.arr[i];
+    NC.ranges.len = kept;
+
+    pthread_mutex_unlock(&NA.lock);
+}
 
-        BRL_find_remove(&NA.used_headers, header);
-        BRL_push(&NA.free_headers, header);
+/*
+ * Adds the writable segments of a loaded object to the roots, where the
+ * program and its libraries keep their globals: `.data`, `.bss` and the like.
+ */
+int add_segments(struct dl_phdr_info* info, size_t size, void* data) {
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_W)) {
+            uint8_t* start = (uint8_t*)(info->dlpi_addr + phdr->p_vaddr);
+            gc_add_roots(start, start + phdr->p_memsz);
+        }
     }
+
+    return 0;
 }
 
-// If they happen to have the same number that they don't mean as a pointer,
-// then we have a false positive, which is fine
-//
-// Also, they could modify their pointer with the intention of obfuscating it
-// from us, we're not going to worry about this case
-void garbage_collect() {
-    bool used_blocks[NA.used_headers.len];
-    memset(used_blocks, 0, NA.used_headers.len);
+uint16_t register_layout(size_t size, const size_t* offsets, size_t count) {
+    size_t words = size / sizeof(uintptr_t);
+    if (size == 0 || size % sizeof(uintptr_t) != 0 || words > UINT32_MAX)
+        return 0;
+
+    for (size_t i = 0; i < count; i++)
+        if (offsets[i] % sizeof(uintptr_t) != 0 || offsets[i] >= size)
+            return 0;
+
+    uint64_t* bits = map_new((words + 63) / 64 * sizeof(uint64_t));
+    if (bits == MAP_FAILED)
+        return 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t word = offsets[i] / sizeof(uintptr_t);
+        bits[word / 64] |= 1ull << (word % 64);
+    }
+
+    pthread_mutex_lock(&NA.lock);
+
+    if (NC.layouts == NULL) {
+        Layout* layouts = map_new(GC_MAX_LAYOUTS * sizeof(Layout));
+        if (layouts != MAP_FAILED)
+            NC.layouts = layouts;
+    }
+
+    uint16_t id = 0;
+    if (NC.layouts != NULL && NC.layout_count + 1 < GC_MAX_LAYOUTS) {
+        id = NC.layout_count + 1;
+        NC.layouts[id] = (Layout){words, bits};
+        __atomic_store_n(&NC.layout_count, id, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&NA.lock);
+
+    if (id == 0)
+        munmap(bits, (words + 63) / 64 * sizeof(uint64_t));
+
+    return id;
+}
+
+void add_static_roots() {
+    for (size_t i = 0; i < NC.ranges.len; i++)
+        add_roots(NC.ranges.arr[i].buf, NC.ranges.arr[i].size);
+}
+
+void add_card(void* card) {
+    add_roots(card, PM_CARD_SIZE / sizeof(uintptr_t));
+}
+
+/*
+ * Marks every block reachable from the roots.
+ *
+ * If a deque overflowed along the way, some marked blocks were never scanned,
+ * so every marked block in the heap is scanned again. Blocks that are already
+ * marked are never pushed twice, so this terminates once a rescan doesn't
+ * overflow.
+ */
+void mark() {
+    NC.rescanning = false;
+    run_mark_phase();
+
+    while (NC.overflowed) {
+        NC.overflowed = false;
+        NC.rescanning = true;
+        run_mark_phase();
+    }
+}
+
+/*
+ * Gives every slot of a slab that was handed out but not marked back to its
+ * pool.
+ *
+ * The owner of the pool may be stopped anywhere, so the slots go onto the
+ * list it takes from atomically, never onto its free list.
+ */
+void sweep_slab(PoolSlab* slab) {
+    Pool* pool = slab->pool;
+
+    for (uint32_t word = 0; word < (slab->count + 63) / 64; word++) {
+        uint64_t dead = slab->allocated[word] & ~slab->marks[word];
+        if (dead == 0)
+            continue;
+
+        __atomic_fetch_and(&slab->allocated[word], ~dead, __ATOMIC_RELAXED);
+
+        for (; dead != 0; dead &= dead - 1) {
+            void* slot =
+                slab->slots + (word * 64 + __builtin_ctzll(dead)) * pool->size;
+            *(void**)slot = pool->reclaimed;
+            __atomic_store_n(&pool->reclaimed, slot, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*
+ * Frees every block that wasn't marked, and sets `NC.heap_live` to the bytes
+ * in the blocks that are left.
+ *
+ * Returns the bytes freed
+ */
+size_t sweep() {
+    size_t freed = 0;
+    size_t used = 0;
+    for (uint32_t i = 0; i < NA.headers.len; i++) {
+        Block* header = BL_idx(&NA.headers, i);
+        if (header->ptr == NULL || is_free(header))
+            continue;
+
+        used += header->size;
+
+        // Slabs live as long as their pool, only their slots are swept
+        if (header->flags & BLOCK_POOL) {
+            if (!NC.minor)
+                sweep_slab(block_data(header));
+            continue;
+        }
+
+        BlockTag* tag = (BlockTag*)block_data(header) - 1;
+        if (is_marked(i)) {
+            // Promoted in place
+            if (NA.generational)
+                tag->young = false;
+            continue;
+        }
+
+        // Blocks sitting in a thread cache are owned by that thread
+        if (tag->cached)
+            continue;
+
+        // Old blocks are never marked by a minor collection
+        if (NC.minor && !tag->young)
+            continue;
+
+        // Handed out after the incremental cycle started
+        if (NC.cycle_active && tag->epoch == NC.epoch)
+            continue;
+
+        freed += header->size;
+        if (header->flags & BLOCK_LARGE) {
+            free_large(i);
+        } else {
+            free_block(i);
+            try_merge_block(i);
+        }
+    }
+
+    NC.heap_live = used - freed;
+    return freed;
+}
+
+/*
+ * Purges every free block right away after a collection that freed a large
+ * part of the heap, most of it won't be needed again soon, or that left more
+ * mapped than the memory limit.
+ */
+void purge_after(size_t freed) {
+    size_t mapped = __atomic_load_n(&NA.mapped, __ATOMIC_RELAXED);
+    if (freed >= mapped / PURGE_COLLECT_SHARE ||
+        (NC.memory_limit != 0 && mapped > NC.memory_limit))
+        purge_blocks(UINT64_MAX);
+}
+
+// Pacing
+
+/*
+ * Sets the goal for the next full collection from what the last one left
+ * alive.
+ */
+void update_heap_goal() {
+    if (NC.gc_percent < 0) {
+        NC.heap_goal = SIZE_MAX;
+        return;
+    }
+
+    size_t goal = NC.heap_live + NC.heap_live / 100 * NC.gc_percent;
+    NC.heap_goal = goal > GC_MIN_HEAP ? goal : GC_MIN_HEAP;
+}
+
+/*
+ * Starts counting towards the next collection once one is over.
+ */
+void pace_after(bool minor) {
+    NA.in_use = NC.heap_live;
+
+    // A minor collection only tells how much of the young blocks is alive, the
+    // old generation may have grown since the goal was set
+    if (!minor)
+        update_heap_goal();
+}
+
+bool collection_due(size_t needed) {
+    if (NC.disabled)
+        return false;
+
+    size_t goal = NC.heap_goal;
+    if (NC.memory_limit != 0 && NC.memory_limit < goal) {
+        goal = NC.memory_limit;
+        if (goal < NC.heap_live + GC_LIMIT_HEADROOM)
+            goal = NC.heap_live + GC_LIMIT_HEADROOM;
+    }
+
+    return goal != SIZE_MAX && NA.in_use + needed >= goal;
+}
+
+void collect_paced() {
+    if (NC.incremental)
+        collect_incremental();
+    else
+        collect();
+}
+
+void set_gc_percent(int percent) {
+    pthread_mutex_lock(&NA.lock);
+    NC.gc_percent = percent;
+    update_heap_goal();
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void set_memory_limit(size_t limit) {
+    pthread_mutex_lock(&NA.lock);
+    NC.memory_limit = limit;
+    pthread_mutex_unlock(&NA.lock);
+}
+
+/*
+ * Reads `NARSIRABAD_GOGC` and `NARSIRABAD_MEMORY_LIMIT`, see `set_gc_percent`
+ * and `set_memory_limit`.
+ */
+void read_pacing_env() {
+    NC.gc_percent = GC_PERCENT;
+
+    const char* percent = getenv("NARSIRABAD_GOGC");
+    if (percent != NULL && strcmp(percent, "off") == 0) {
+        NC.gc_percent = -1;
+    } else if (percent != NULL) {
+        char* end;
+        long value = strtol(percent, &end, 10);
+        if (end == percent || *end != '\0' || value < 0 || value > INT32_MAX) {
+            printf("Invalid NARSIRABAD_GOGC: %s\n", percent);
+            exit(1);
+        }
+        NC.gc_percent = value;
+    }
+
+    const char* limit = getenv("NARSIRABAD_MEMORY_LIMIT");
+    if (limit != NULL) {
+        char* end;
+        unsigned long long value = strtoull(limit, &end, 10);
+        int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+        if (shift != 0)
+            end++;
+
+        if (end == limit || *end != '\0' || value > SIZE_MAX >> shift) {
+            printf("Invalid NARSIRABAD_MEMORY_LIMIT: %s\n", limit);
+            exit(1);
+        }
+        NC.memory_limit = value << shift;
+    }
+
+    update_heap_goal();
+}
+
+// Stopping the world
+//
+// A collection can't let any other thread touch the heap or move a pointer out
+// from under it, so the collecting thread sends `SIG_SUSPEND` to every other
+// registered thread. Each of them records the end of its stack and its
+// registers, acknowledges through `NC.acks`, and waits inside the handler until
+// `SIG_RESUME` tells it the collection is over.
+
+void suspend_handler(int sig, siginfo_t* info, void* context) {
+    int saved_errno = errno;
+
+    mutator.top_of_stack = (uintptr_t)__builtin_stack_address();
+    memcpy(&mutator.registers, &((ucontext_t*)context)->uc_mcontext,
+           sizeof(mcontext_t));
+
+    sem_post(&NC.acks);
+
+    // `SIG_RESUME` is blocked while we're in here, so one that arrives before
+    // `sigsuspend` stays pending instead of getting lost
+    sigset_t mask;
+    sigfillset(&mask);
+    sigdelset(&mask, SIG_RESUME);
+    while (NC.world_stopped)
+        sigsuspend(&mask);
+
+    sem_post(&NC.acks);
+
+    errno = saved_errno;
+}
+
+void resume_handler(int sig) {}
+
+void init_collector() {
+    sem_init(&NC.acks, 0, 0);
+
+    pthread_mutex_init(&NC.workers_lock, NULL);
+    pthread_cond_init(&NC.phase_started, NULL);
+    pthread_cond_init(&NC.phase_finished, NULL);
+
+    struct sigaction action = {0};
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    action.sa_sigaction = suspend_handler;
+    sigfillset(&action.sa_mask);
+    if (sigaction(SIG_SUSPEND, &action, NULL) == -1) {
+        printf("Failed to install the suspend handler\n");
+        exit(1);
+    }
+
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = resume_handler;
+    if (sigaction(SIG_RESUME, &action, NULL) == -1) {
+        printf("Failed to install the resume handler\n");
+        exit(1);
+    }
+
+    read_pacing_env();
+
+    // Libraries loaded later with `dlopen` have to add their own
+    dl_iterate_phdr(add_segments, NULL);
+
+    // Neither holds anything the heap needs kept alive, but both point into it
+    gc_remove_roots(&NA, &NA + 1);
+    gc_remove_roots(&NC, &NC + 1);
+}
+
+/*
+ * Waits until `count` threads have posted to `NC.acks`.
+ */
+void wait_for_acks(uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        while (sem_wait(&NC.acks) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+/*
+ * Sends `sig` to every registered thread but the calling one.
+ *
+ * Returns the number of threads the signal was sent to
+ */
+uint32_t signal_mutators(int sig) {
+    uint32_t count = 0;
+    for (Mutator* m = NA.mutators; m != NULL; m = m->next) {
+        if (m == &mutator)
+            continue;
+
+        if (pthread_kill(m->thread, sig) == 0)
+            count++;
+    }
+
+    return count;
+}
+
+/*
+ * Stops every registered thread but the calling one, returning once they have
+ * all recorded their stacks and registers.
+ *
+ * `NA.lock` must be held, which also keeps threads from registering or leaving
+ * while the world is stopped
+ */
+void stop_world() {
+    NC.world_stopped = true;
+    wait_for_acks(signal_mutators(SIG_SUSPEND));
+}
+
+/*
+ * Lets every thread stopped by `stop_world` run again, returning once they have
+ * all left the suspend handler.
+ */
+void resume_world() {
+    NC.world_stopped = false;
+    wait_for_acks(signal_mutators(SIG_RESUME));
+}
+
+void register_mutator() {
+    if (mutator.registered)
+        return;
+
+    if (mutator.bottom_of_stack == 0) {
+        pthread_attr_t attr;
+        void* stack_addr;
+        size_t stack_size;
+
+        pthread_getattr_np(pthread_self(), &attr);
+        pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+        pthread_attr_destroy(&attr);
+
+        mutator.bottom_of_stack = (uintptr_t)stack_addr + stack_size;
+    }
+
+    mutator.thread = pthread_self();
+
+    pthread_mutex_lock(&NA.lock);
+    mutator.prev = NULL;
+    mutator.next = NA.mutators;
+    if (NA.mutators != NULL)
+        NA.mutators->prev = &mutator;
+    NA.mutators = &mutator;
+    mutator.registered = true;
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void unregister_mutator() {
+    if (!mutator.registered)
+        return;
+
+    pthread_mutex_lock(&NA.lock);
+    if (mutator.prev != NULL)
+        mutator.prev->next = mutator.next;
+    else
+        NA.mutators = mutator.next;
+
+    if (mutator.next != NULL)
+        mutator.next->prev = mutator.prev;
+    mutator.registered = false;
+
+    // Kept for `nar_stats`, the thread may register again
+    NA.allocations += mutator.allocations;
+    NA.frees += mutator.frees;
+    mutator.allocations = 0;
+    mutator.frees = 0;
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void collector_after_fork() {
+    // The forking thread is the only one left to stop
+    NA.mutators = NULL;
+    if (mutator.registered) {
+        mutator.prev = NULL;
+        mutator.next = NULL;
+        NA.mutators = &mutator;
+    }
+
+    sem_init(&NC.acks, 0, 0);
+
+    // The helpers are gone too, so the child marks on its own
+    pthread_mutex_init(&NC.workers_lock, NULL);
+    pthread_cond_init(&NC.phase_started, NULL);
+    pthread_cond_init(&NC.phase_finished, NULL);
+    if (NC.workers_started)
+        NC.worker_count = 1;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Adds the time since `since` to a part of the collection.
+ *
+ * Returns the current time, where the next part starts
+ */
+uint64_t time_phase(int phase, uint64_t since) {
+    uint64_t now = now_ns();
+    NC.phase_time[phase] += now - since;
+    return now;
+}
+
+void record_pause(uint64_t start) {
+    uint64_t pause = now_ns() - start;
+
+    NC.pauses++;
+    NC.last_pause = pause;
+    NC.total_pause += pause;
+    if (pause > NC.max_pause)
+        NC.max_pause = pause;
+}
+
+// If they happen to have the same number that they don't mean as a pointer,
+// then we have a false positive, which is fine
+//
+// Also, they could modify their pointer with the intention of obfuscating it
+// from us, we're not going to worry about this case
+//
+// `NA.lock` must be held
+//
+// Nothing in here may take a lock another thread could be holding when it is
+// stopped, that rules out `printf` and `malloc`
+void run_collection(bool minor) {
+    if (!NC.workers_started)
+        start_workers();
+
+    uint64_t start = now_ns();
+    stop_world();
+    uint64_t lap = time_phase(GC_TIME_STOP, start);
+
+    NC.minor = minor;
+    prepare_marks();
+
+    add_stacks();
+    add_static_roots();
+    add_arenas();
+
+    // Once the collection is over nothing is young any more, so the cards
+    // are only needed by a minor collection, but always cleaned
+    if (NA.generational)
+        PM_take_dirty_cards(&NA.page_map, minor ? add_card : NULL);
+    lap = time_phase(GC_TIME_ROOTS, lap);
+
+    mark();
+    lap = time_phase(GC_TIME_MARK, lap);
+
+    // The sweep has to finish before anyone can pop a block from their cache,
+    // since cached blocks aren't marked
+    size_t freed = sweep();
+    lap = time_phase(GC_TIME_SWEEP, lap);
+
+    resume_world();
+    time_phase(GC_TIME_STOP, lap);
+
+    record_pause(start);
+    NC.collections++;
+    if (minor)
+        NC.minor_collections++;
+    pace_after(minor);
+
+    NAR_TRACE(NAR_EVENT_COLLECT, minor, NC.last_pause);
+
+    // Only the collecting thread waits for this, the world is already going
+    purge_after(freed);
+}
+
+// Incremental marking
+//
+// A cycle starts with a short pause that clears the marks, starts tracking
+// writes to the heap and marks what the roots point to. The blocks those point
+// to are then scanned a slice at a time while the mutators run. Anything they
+// write in the meantime lands on a tracked page, so a second short pause
+// rescans the roots and the live blocks on every written page, and then sweeps.
+//
+// Blocks handed out during the cycle carry its epoch and are kept alive by it,
+// their contents are on written pages anyway.
+
+/*
+ * Calls `visit` with every mapping of the heap.
+ */
+void for_each_mapping(void (*visit)(void* ptr, size_t size)) {
+    for (uint32_t i = 0; i < NA.headers.len; i++) {
+        Block* header = BL_idx(&NA.headers, i);
+        // Only the first block of every mapping
+        if (header->ptr == NULL || header->prev_phys != BLOCK_NONE)
+            continue;
+
+        Block* last = header;
+        while (last->next_phys != BLOCK_NONE)
+            last = BL_idx(&NA.headers, last->next_phys);
+
+        visit(header->ptr,
+              (uint8_t*)last->ptr + last->size - (uint8_t*)header->ptr);
+    }
+}
+
+void protect_mapping(void* ptr, size_t size) { map_protect(ptr, size, false); }
+
+void unprotect_mapping(void* ptr, size_t size) { map_protect(ptr, size, true); }
+
+/*
+ * Copies the soft-dirty bit of every page of a mapping to its `written` flag.
+ */
+void read_soft_dirty(void* ptr, size_t size) {
+    uint64_t entries[512];
+    uintptr_t start = (uintptr_t)ptr;
+    size_t pages = size >> PM_PAGE_SHIFT;
+
+    for (size_t done = 0; done < pages;) {
+        size_t count = pages - done < 512 ? pages - done : 512;
+        off_t offset = ((start >> PM_PAGE_SHIFT) + done) * sizeof(uint64_t);
+
+        ssize_t bytes = pread(NC.pagemap, entries, count * sizeof(uint64_t),
+                              offset);
+        if (bytes != (ssize_t)(count * sizeof(uint64_t))) {
+            // Without the bits, every page has to be taken as written
+            for (size_t i = 0; i < count; i++)
+                entries[i] = 1ull << 55;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i] & (1ull << 55)) {
+                uintptr_t page = start + ((done + i) << PM_PAGE_SHIFT);
+                PM_entry(&NA.page_map, page, true)->written = 1;
+            }
+        }
+
+        done += count;
+    }
+}
+
+bool clear_soft_dirty() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd == -1)
+        return false;
+
+    bool cleared = write(fd, "4", 1) == 1;
+    close(fd);
+
+    return cleared;
+}
+
+/*
+ * Whether the kernel keeps soft-dirty bits, tried out on a page of our own.
+ */
+bool soft_dirty_works() {
+    NC.pagemap = open("/proc/self/pagemap", O_RDONLY);
+    if (NC.pagemap == -1)
+        return false;
+
+    size_t page_size = getpagesize();
+    volatile uint8_t* page = map_new(page_size);
+    if (page == MAP_FAILED)
+        return false;
+
+    uint64_t entry = 0;
+    off_t offset = ((uintptr_t)page >> PM_PAGE_SHIFT) * sizeof(uint64_t);
+
+    page[0] = 1;
+    bool works = clear_soft_dirty() &&
+                 pread(NC.pagemap, &entry, sizeof(entry), offset) ==
+                     sizeof(entry) &&
+                 !(entry & (1ull << 55));
+
+    page[0] = 2;
+    works = works &&
+            pread(NC.pagemap, &entry, sizeof(entry), offset) ==
+                sizeof(entry) &&
+            (entry & (1ull << 55));
+
+    munmap((void*)page, page_size);
+    if (!works) {
+        close(NC.pagemap);
+        NC.pagemap = -1;
+    }
+
+    return works;
+}
+
+/*
+ * Write-protection faults on the heap during a cycle record the page as written
+ * and make it writable again, anything else goes to whatever handler was there
+ * before us.
+ */
+void segv_handler(int sig, siginfo_t* info, void* context) {
+    uintptr_t addr = (uintptr_t)info->si_addr;
+
+    if (NC.cycle_active && addr >= NA.page_map.min &&
+        addr < NA.page_map.max) {
+        PageEntry* entry = PM_entry(&NA.page_map, addr, false);
+        void* page = (void*)(addr & ~(PM_PAGE_SIZE - 1));
+
+        // Recorded first, other threads can write without faulting as soon as
+        // the page is writable
+        if (entry != NULL) {
+            entry->written = 1;
+            if (map_protect(page, PM_PAGE_SIZE, true) == 0)
+                return;
+        }
+    }
+
+    struct sigaction* old = &NC.old_segv_action;
+    if (old->sa_flags & SA_SIGINFO) {
+        old->sa_sigaction(sig, info, context);
+    } else if (old->sa_handler == SIG_DFL || old->sa_handler == SIG_IGN) {
+        // Returning retries the access, which faults again without us
+        sigaction(SIGSEGV, old, NULL);
+    } else {
+        old->sa_handler(sig);
+    }
+}
+
+void gc_enable_incremental(size_t slice_words, uint64_t slice_time) {
+    pthread_mutex_lock(&NA.lock);
+
+    NC.slice_words = slice_words;
+    NC.slice_time = slice_time;
+
+    if (!NC.incremental) {
+        NC.soft_dirty = soft_dirty_works();
+
+        if (!NC.soft_dirty) {
+            struct sigaction action = {0};
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            action.sa_sigaction = segv_handler;
+            sigemptyset(&action.sa_mask);
+            sigaddset(&action.sa_mask, SIG_SUSPEND);
+            if (sigaction(SIGSEGV, &action, &NC.old_segv_action) == -1) {
+                printf("Failed to install the write fault handler\n");
+                exit(1);
+            }
+        }
+
+        NC.incremental = true;
+    }
+
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void track_mapping(void* ptr, size_t size) {
+    if (!NC.cycle_active)
+        return;
+
+    for (size_t offset = 0; offset < size; offset += PM_PAGE_SIZE)
+        PM_entry(&NA.page_map, (uintptr_t)ptr + offset, true)->written = 1;
+}
+
+void start_tracking() {
+    if (NC.soft_dirty && clear_soft_dirty())
+        return;
+
+    NC.soft_dirty = false;
+    for_each_mapping(protect_mapping);
+}
+
+void stop_tracking() {
+    if (NC.soft_dirty)
+        for_each_mapping(read_soft_dirty);
+    else
+        for_each_mapping(unprotect_mapping);
+}
+
+/*
+ * Adds the parts of the marked slots of a slab that lie on the page
+ * `[start, end)` to the roots.
+ */
+void add_live_slots(PoolSlab* slab, uintptr_t start, uintptr_t end) {
+    size_t size = slab->pool->size;
+    uintptr_t slots = (uintptr_t)slab->slots;
+
+    size_t first = start > slots ? (start - slots) / size : 0;
+    for (size_t i = first; i < slab->count; i++) {
+        uintptr_t from = slots + i * size;
+        if (from >= end)
+            break;
+
+        if (!(slab->marks[i / 64] & (1ull << (i % 64))))
+            continue;
+
+        uintptr_t to = from + size < end ? from + size : end;
+        from = from > start ? from : start;
+        add_roots((uintptr_t*)from, (to - from) / sizeof(uintptr_t));
+    }
+}
+
+/*
+ * Adds the part of a block that lies on the page `[start, end)` to the roots,
+ * if the block is alive so far. Atomic blocks are left out, and typed ones
+ * only have their pointers on the page marked through.
+ *
+ * A block that isn't marked yet will be scanned whole if it turns out to be
+ * alive.
+ */
+void add_live_part(uint32_t block_idx, uintptr_t start, uintptr_t end) {
+    if (block_idx >= NA.headers.len)
+        return;
+
+    Block* header = BL_idx(&NA.headers, block_idx);
+    if (header->ptr == NULL || is_free(header))
+        return;
+
+    if (header->flags & BLOCK_POOL) {
+        add_live_slots(block_data(header), start, end);
+        return;
+    }
+
+    BlockTag* tag = (BlockTag*)block_data(header) - 1;
+    if (!is_marked(block_idx) && tag->epoch != NC.epoch)
+        return;
+
+    // Written to or not, there's nothing in it to scan
+    if (tag->atomic)
+        return;
+
+    uintptr_t data = (uintptr_t)block_data(header);
+    uintptr_t block_end = (uintptr_t)header->ptr + header->size;
+
+    uintptr_t from = data > start ? data : start;
+    uintptr_t to = block_end < end ? block_end : end;
+    if (from >= to)
+        return;
+
+    // Roots are scanned word by word
+    if (tag->layout != 0) {
+        scan_typed(&NC.workers[0], (uintptr_t*)data,
+                   (from - data) / sizeof(uintptr_t),
+                   (to - data) / sizeof(uintptr_t), tag->layout);
+        return;
+    }
+
+    add_roots((uintptr_t*)from, (to - from) / sizeof(uintptr_t));
+}
+
+/*
+ * Adds the live blocks on a page written to during the cycle to the roots: the
+ * block running into the page, and every block whose tag is on it.
+ */
+void add_written_page(void* page) {
+    uintptr_t start = (uintptr_t)page;
+    uintptr_t end = start + PM_PAGE_SIZE;
+    PageEntry* entry = PM_entry(&NA.page_map, start, false);
+
+    add_live_part(entry->covering - 1, start, end);
+
+    for (size_t word = 0; word < PM_GRANULES / 64; word++) {
+        for (uint64_t bits = entry->starts[word]; bits != 0; bits &= bits - 1) {
+            size_t granule = word * 64 + __builtin_ctzll(bits);
+            BlockTag* tag = (BlockTag*)(start + granule * ALIGNMENT);
+
+            if (tag->magic == BLOCK_MAGIC)
+                add_live_part(tag->idx, start, end);
+        }
+    }
+}
+
+void start_cycle() {
+    if (!NC.workers_started)
+        start_workers();
+
+    uint64_t start = now_ns();
+    stop_world();
+    uint64_t lap = time_phase(GC_TIME_STOP, start);
+
+    NC.minor = false;
+    NC.epoch++;
+    prepare_marks();
+
+    NC.cycle_active = true;
+    start_tracking();
+
+    add_stacks();
+    add_static_roots();
+    add_arenas();
+    for (size_t i = 0; i < NC.roots.len; i++) {
+        mark_used_blocks_by_ptrs_in_buffer(&NC.workers[0], NC.roots.arr[i].buf,
+                                           NC.roots.arr[i].size);
+    }
+    lap = time_phase(GC_TIME_ROOTS, lap);
+
+    resume_world();
+    time_phase(GC_TIME_STOP, lap);
+
+    record_pause(start);
+    NAR_TRACE(NAR_EVENT_CYCLE_START, NC.epoch, NC.last_pause);
+}
+
+void finish_cycle() {
+    uint64_t start = now_ns();
+    stop_world();
+    uint64_t lap = time_phase(GC_TIME_STOP, start);
+
+    stop_tracking();
+
+    NC.roots.len = 0;
+    add_stacks();
+    add_static_roots();
+    add_arenas();
+    PM_take_written_pages(&NA.page_map, add_written_page);
+
+    if (NA.generational)
+        PM_take_dirty_cards(&NA.page_map, NULL);
+    lap = time_phase(GC_TIME_ROOTS, lap);
+
+    mark();
+    lap = time_phase(GC_TIME_MARK, lap);
+
+    size_t freed = sweep();
+    lap = time_phase(GC_TIME_SWEEP, lap);
+
+    NC.cycle_active = false;
+
+    resume_world();
+    time_phase(GC_TIME_STOP, lap);
+
+    record_pause(start);
+    NC.collections++;
+    pace_after(false);
+
+    NAR_TRACE(NAR_EVENT_CYCLE_FINISH, NC.epoch, NC.last_pause);
+
+    purge_after(freed);
+}
+
+bool mark_slice() {
+    MarkWorker* worker = &NC.workers[0];
+    uint64_t start = now_ns();
+    uint64_t deadline = NC.slice_time != 0 ? start + NC.slice_time : 0;
+    size_t scanned = 0;
+
+    while (NC.slice_words == 0 || scanned < NC.slice_words) {
+        uint32_t block_idx = deque_pop(&worker->deque);
+        if (block_idx == BLOCK_NONE)
+            break;
+
+        // Freed since it was marked
+        Block* header = BL_idx(&NA.headers, block_idx);
+        if (header->ptr == NULL || is_free(header))
+            continue;
+
+        scan_block(worker, block_idx);
+        scanned += header->size / sizeof(uintptr_t);
+
+        if (deadline != 0 && now_ns() >= deadline)
+            break;
+    }
+
+    time_phase(GC_TIME_SLICES, start);
+    return deque_is_empty(&worker->deque);
+}
+
+void collect_step() {
+    if (NC.cycle_active && mark_slice())
+        finish_cycle();
+}
+
+void collect_incremental() {
+    if (!NC.cycle_active)
+        start_cycle();
+}
+
+// A cycle in progress is finished rather than started over, its final pause
+// marks everything that is still reachable
+void collect() {
+    if (NC.cycle_active)
+        finish_cycle();
+    else
+        run_collection(false);
+}
+
+void collect_minor() {
+    if (NC.cycle_active)
+        finish_cycle();
+    else
+        run_collection(true);
+}
+
+void gc_write_barrier(void* field) {
+    if (NA.generational)
+        PM_dirty_card(&NA.page_map, field);
+}
+
+void gc_collect() { garbage_collect(); }
+
+void gc_disable() {
+    pthread_mutex_lock(&NA.lock);
+    NC.disabled++;
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void gc_enable() {
+    gc_register_thread();
+
+    // Spills the registers the caller might keep pointers in into this frame,
+    // above the address taken below
+    __builtin_unwind_init();
+    uintptr_t stack_address = (uintptr_t)__builtin_stack_address();
+
+    pthread_mutex_lock(&NA.lock);
+    if (NC.disabled > 0)
+        NC.disabled--;
+
+    // Whatever was put off while they were disabled
+    if (collection_due(0)) {
+        mutator.top_of_stack = stack_address;
+        collect_paced();
+    }
+    pthread_mutex_unlock(&NA.lock);
+}
+
+void garbage_collect() {
+    gc_register_thread();
+
+    // Spills the registers the caller might keep pointers in into this frame,
+    // above the address taken below
+    __builtin_unwind_init();
 
-    mark_stack(used_blocks);
-    mark_bss(used_blocks);
-    mark_registers(used_blocks);
+    // Everything above this frame is scanned
+    uintptr_t stack_address = (uintptr_t)__builtin_stack_address();
 
-    sweep(used_blocks);
+    pthread_mutex_lock(&NA.lock);
+    mutator.top_of_stack = stack_address;
+    collect();
+    pthread_mutex_unlock(&NA.lock);
 }
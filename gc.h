@@ -1,12 +1,335 @@
 #ifndef NARSIRABAD_GC
 #define NARSIRABAD_GC
 #include "alloc.h"
+#include <semaphore.h>
+#include <signal.h>
 #include <stdint.h>
 
+// Parallel marking
+//
+// Every collection spreads its roots over up to `GC_MAX_WORKERS` threads: the
+// collecting thread and helper threads started on the first collection. Each
+// worker keeps the blocks it has marked but not scanned yet in its own deque,
+// and steals from the others once it runs out.
+#define GC_MAX_WORKERS 8
+// Roots are handed out this many words at a time
+#define ROOT_CHUNK 4096
+// After an overflow, marked blocks are rescanned this many headers at a time
+#define RESCAN_CHUNK 4096
+// Entries in every worker's deque
+#define MARK_DEQUE_CAP (1 << 16)
+
+// Pacing
+//
+// A full collection is due once the heap in use, `Allocator.in_use`, reaches
+// `Collector.heap_goal`. It's what the last collection left alive plus what
+// was allocated since, less what was deallocated since. The goal leaves room
+// for `gc_percent` percent of the live heap on top of it,
+// but is never less than `GC_MIN_HEAP`, so a small heap isn't collected over
+// and over. Until a collection is due, running out of room grows the heap.
+//
+// A soft memory limit caps the goal, though it always leaves at least
+// `GC_LIMIT_HEADROOM` past the live heap, so a program that keeps more than the
+// limit alive doesn't spend all its time collecting.
+#define GC_PERCENT 100
+#define GC_MIN_HEAP (4ul << 20)
+#define GC_LIMIT_HEADROOM (1ul << 20)
+
+// Parts of a collection whose durations are kept in `Collector.phase_time`
+//
+// Stopping includes resuming the world again, and the roots include clearing
+// the marks. Slices are the marking an incremental cycle does between pauses.
+#define GC_TIME_STOP 0
+#define GC_TIME_ROOTS 1
+#define GC_TIME_MARK 2
+#define GC_TIME_SWEEP 3
+#define GC_TIME_SLICES 4
+#define GC_TIMES 5
+
+// Entries in `Collector.layouts`, layout ids start at 1
+#define GC_MAX_LAYOUTS 4096
+
+// Which words of a typed object may hold pointers
+typedef struct {
+    // The size of the object in words, a block holds as many as fit
+    uint32_t words;
+    // One bit per word, set for the words that are scanned
+    uint64_t* bits;
+} Layout;
+
+// Blocks that have been marked but whose contents have not been scanned yet
+//
+// A Chase-Lev deque: its owner pushes and pops at `bottom`, other workers
+// steal from `top`. It doesn't grow, when it's full the block is left marked
+// but unscanned and `Collector.overflowed` is set, so that the heap can be
+// rescanned for it later
+typedef struct {
+    uint32_t* arr;
+    int64_t top;
+    int64_t bottom;
+} MarkDeque;
+
+typedef struct {
+    MarkDeque deque;
+    pthread_t thread;
+    // Picks the first worker to try stealing from
+    uint32_t seed;
+    // Bytes of block data this worker scanned over all collections, rescans
+    // included, and bytes it marked without scanning: all of an atomic block,
+    // the scalars of a typed one. Kept per worker so they don't share a line
+    uint64_t bytes_scanned;
+    uint64_t bytes_skipped;
+} __attribute__((aligned(64))) MarkWorker;
+
+// A buffer of potential pointers to be scanned by one worker
+typedef struct {
+    uintptr_t* buf;
+    size_t size;
+} RootRange;
+
+typedef struct {
+    RootRange* arr;
+    size_t len;
+    size_t cap;
+} RootList;
+
+typedef struct {
+    // `workers[0]` is whichever thread is collecting
+    MarkWorker workers[GC_MAX_WORKERS];
+    uint32_t worker_count;
+    bool workers_started;
+
+    // Wakes the helpers for every mark phase, `phase` counts them
+    pthread_mutex_t workers_lock;
+    pthread_cond_t phase_started;
+    pthread_cond_t phase_finished;
+    uint64_t phase;
+    // Helpers done with the current phase
+    uint32_t finished;
+
+    RootList roots;
+    // Memory outside of the heap scanned by every collection, the writable
+    // segments of everything loaded at startup and whatever `gc_add_roots`
+    // added, less what `gc_remove_roots` took out
+    RootList ranges;
+    // The next root to be claimed, or header chunk while `rescanning`
+    size_t next_root;
+    bool rescanning;
+    // Workers that haven't run out of work, the phase ends when it hits `0`
+    uint32_t active;
+    bool overflowed;
+
+    // Indexed by layout id, `layouts[0]` is never used. Mapped on the first
+    // registration, and only ever appended to under `NA.lock`
+    Layout* layouts;
+    uint32_t layout_count;
+
+    // Whether the current collection only traces young blocks
+    bool minor;
+    // Non-zero when running out of room grows the heap instead of collecting,
+    // collections only happen when asked for. Counts `gc_disable` calls not
+    // matched by `gc_enable` yet
+    uint32_t disabled;
+
+    // See Pacing above, a negative `gc_percent` only collects when the heap
+    // runs out of room, and a `memory_limit` of `0` is no limit
+    int gc_percent;
+    size_t memory_limit;
+    // Bytes in blocks the last collection left in use, and the heap in use at
+    // which the next full collection is due, `SIZE_MAX` for never
+    size_t heap_live;
+    size_t heap_goal;
+
+    // Incremental marking, see `gc_enable_incremental`
+    bool incremental;
+    size_t slice_words;
+    uint64_t slice_time;
+    // Set between the two pauses of an incremental cycle
+    bool cycle_active;
+    // Bumped at the start of every cycle, see `BlockTag.epoch`
+    uint8_t epoch;
+    // Whether writes are tracked through the kernel's soft-dirty bits rather
+    // than by write-protecting the heap
+    bool soft_dirty;
+    // `/proc/self/pagemap`, in soft-dirty mode
+    int pagemap;
+    struct sigaction old_segv_action;
+
+    // One bit per header in `NA.headers`, set for every block found alive
+    uint64_t* marks;
+    // Capacity of `marks` in bits
+    size_t marks_cap;
+
+    // Posted by every thread once it has stopped, and once it has resumed
+    sem_t acks;
+    // Set while a collection has the world stopped
+    volatile sig_atomic_t world_stopped;
+
+    uint64_t collections;
+    uint64_t minor_collections;
+    // How long collections kept the world stopped, in nanoseconds, an
+    // incremental cycle stops it twice
+    uint64_t pauses;
+    uint64_t last_pause;
+    uint64_t max_pause;
+    uint64_t total_pause;
+    // Nanoseconds spent in every part of a collection, see `GC_TIME_STOP`
+    uint64_t phase_time[GC_TIMES];
+} Collector;
+
 /// If they happen to have the same number that they don't mean as a pointer,
 /// then we have a false positive, which is fine
 ///
 /// Also, they could modify their pointer with the intention of obfuscating it
 /// from us, we're not going to worry about this case
 void garbage_collect();
+
+/// Same as `garbage_collect`
+void gc_collect();
+
+/// Keeps collections from happening until the matching `gc_enable`, for
+/// sections of the program that can't afford a pause
+///
+/// The heap grows instead, calls nest. `garbage_collect` still collects
+void gc_disable();
+
+/// Undoes a `gc_disable`, and collects right away if the last one put off a
+/// collection that was due
+void gc_enable();
+
+/// Sets how much the heap may grow past what the last collection left alive
+/// before the next one, in percent of the latter. `GC_PERCENT` by default, or
+/// the `NARSIRABAD_GOGC` environment variable
+///
+/// A negative percentage, or `off` in the environment, only collects once the
+/// heap runs out of room, or past the memory limit
+void set_gc_percent(int percent);
+
+/// Sets a soft limit on the heap in use, past which collections happen more
+/// often and free memory is handed back to the kernel right after them, `0`
+/// for none. None by default, or the `NARSIRABAD_MEMORY_LIMIT` environment
+/// variable, in bytes with an optional `K`, `M` or `G` suffix
+///
+/// The heap still grows past the limit when what's alive doesn't fit
+void set_memory_limit(size_t limit);
+
+// Whether a full collection is due before `needed` more bytes are taken from
+// the heap, see Pacing above. The caller holds `NA.lock`
+bool collection_due(size_t needed);
+
+// What a collection that `collection_due` asked for runs: starts a cycle in
+// incremental mode, collects everything otherwise. Same requirements as
+// `collect`
+void collect_paced();
+
+// Same as `garbage_collect`, for callers that already hold `NA.lock` and have
+// set their `Mutator.top_of_stack`
+void collect();
+
+// A collection of the young blocks only, same requirements as `collect`
+void collect_minor();
+
+// What `allocate` does when the heap is out of room in incremental mode: starts
+// a cycle, unless one is running already. Same requirements as `collect`
+void collect_incremental();
+
+// Marks for a slice of the cycle in progress, and finishes the cycle once
+// there's nothing left to mark. Same requirements as `collect`
+void collect_step();
+
+// Marks for a slice of the cycle in progress, for callers that hold `NA.lock`
+// but haven't set their top of the stack
+//
+// Returns whether there's nothing left to mark
+bool mark_slice();
+
+/// Switches to incremental collection
+///
+/// Rather than marking everything in one pause, a cycle marks what the roots
+/// point to in a short pause, then a slice at a time whenever a thread takes
+/// the allocator's lock. Pages written to in the meantime are tracked through
+/// the kernel's soft-dirty bits, or else by write-protecting the heap, and are
+/// rescanned in a second short pause before the sweep.
+///
+/// While the heap is write-protected, system calls can't write into blocks.
+///
+/// `slice_words` - How many words a slice scans at most, `0` for no limit
+/// `slice_time` - How many nanoseconds a slice takes at most, `0` for no limit
+void gc_enable_incremental(size_t slice_words, uint64_t slice_time);
+
+// Tracks writes to a mapping added to the heap while a cycle is running
+void track_mapping(void* ptr, size_t size);
+
+/// Switches to generational mode, where most collections only look at the
+/// blocks allocated since the last one
+///
+/// Old blocks aren't traced by a minor collection, so from here on every
+/// pointer stored into a block that has survived a collection has to be
+/// stored with `GC_WRITE`
+void gc_enable_generational();
+
+/// Stores `value` into `field`, which is inside a block, and tells the
+/// collector about it
+///
+/// `GC_WRITE(node->next, other)`
+#define GC_WRITE(field, value)                                                 \
+    do {                                                                       \
+        (field) = (value);                                                     \
+        gc_write_barrier(&(field));                                            \
+    } while (0)
+
+// Dirties the card holding `field` in generational mode
+void gc_write_barrier(void* field);
+
+// A monotonic clock, in nanoseconds
+uint64_t now_ns();
+
+// Installs the signal handlers threads are stopped with
+void init_collector();
+
+/// Registers the layout of a type, for `allocate_typed`
+///
+/// `size` - `sizeof` the type, a multiple of the size of a pointer
+/// `offsets` - The `offsetof` every field of the type that may hold a pointer
+/// `count` - The number of offsets
+///
+/// Returns the id to allocate the type with, or `0` if an offset isn't aligned
+/// to a pointer or lies past `size`, or too many layouts were registered
+uint16_t register_layout(size_t size, const size_t* offsets, size_t count);
+
+/// Has every collection from now on scan the memory from `start` up to `end`
+/// for pointers into the heap, which has to stay mapped until it's removed
+///
+/// The data of the program and of every library loaded along with it is added
+/// when the heap is set up, only memory the program maps itself or libraries
+/// it loads with `dlopen` have to be added
+void gc_add_roots(void* start, void* end);
+
+/// Stops scanning the memory from `start` up to `end`, whether it was added by
+/// `gc_add_roots` or found when the heap was set up
+///
+/// Meant for large tables that never hold pointers into the heap, and for
+/// memory about to be unmapped. Anything only they point to is freed by the
+/// next collection
+void gc_remove_roots(void* start, void* end);
+
+// Maps the mark deques and starts the helper threads, done by the first
+// collection otherwise
+void start_workers();
+
+// Called in the child after a `fork`, where the calling thread is the only one
+// left and `NA.lock` is held
+void collector_after_fork();
+
+/// Makes the calling thread's stack and registers part of every collection
+///
+/// Threads register themselves the first time they allocate or deallocate,
+/// this is only needed for threads that hold on to blocks before then
+void gc_register_thread();
+
+// Adds the calling thread to `NA.mutators`, if it isn't there already
+void register_mutator();
+
+// Removes the calling thread from `NA.mutators`
+void unregister_mutator();
 #endif
@@ -2,11 +2,23 @@
 #include <stdio.h>
 #include <sys/mman.h>
 
-#define PROT PROT_READ | PROT_WRITE | PROT_EXEC
-#define MAP MAP_SHARED | MAP_ANONYMOUS
+#define PROT PROT_READ | PROT_WRITE
+#define MAP MAP_PRIVATE | MAP_ANONYMOUS
 
 void* map_fixed(void* ptr, intptr_t size) {
     return mmap(ptr, size, PROT, MAP | MAP_FIXED, -1, 0);
 }
 
 void* map_new(intptr_t size) { return mmap(NULL, size, PROT, MAP, -1, 0); }
+
+void* map_reserve(intptr_t size) {
+    return mmap(NULL, size, PROT_NONE, MAP | MAP_NORESERVE, -1, 0);
+}
+
+int map_protect(void* ptr, intptr_t size, bool writable) {
+    return mprotect(ptr, size, writable ? PROT : PROT_READ);
+}
+
+int map_huge(void* ptr, intptr_t size, bool huge) {
+    return madvise(ptr, size, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+}
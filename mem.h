@@ -1,7 +1,15 @@
 // Azalea Colburn, 2026
 // Memory mapping wrapper library
 // Provides a wrapper around mmap and munmap
+#include <stdbool.h>
 #include <stdint.h>
 
+// Maps readable and writable memory over part of a reserved range
 void* map_fixed(void* ptr, intptr_t size);
 void* map_new(intptr_t size);
+// Reserves a range of the address space without any memory behind it, which
+// can't be touched until `map_fixed` maps over it
+void* map_reserve(intptr_t size);
+int map_protect(void* ptr, intptr_t size, bool writable);
+// Asks for the range to be backed by transparent huge pages, or not
+int map_huge(void* ptr, intptr_t size, bool huge);
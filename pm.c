@@ -0,0 +1,269 @@
+#include "pm.h"
+#include "alloc.h"
+#include "mem.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define LEVEL_MASK (PM_FANOUT - 1)
+
+PageMap PM_new() {
+    void* mapping = map_new(PM_FANOUT * sizeof(PageMapNode*));
+    if (mapping == MAP_FAILED)
+        exit(1);
+
+    PageMap map;
+    map.nodes = mapping;
+    map.min = UINTPTR_MAX;
+    map.max = 0;
+
+    return map;
+}
+
+/*
+ * Returns the entry for the page containing `addr`.
+ *
+ * Returns `NULL` if the page was never mapped and `create` is false,
+ * otherwise the missing levels of the tree are mapped on the way down.
+ */
+PageEntry* PM_entry(PageMap* map, uintptr_t addr, bool create) {
+    uintptr_t page = addr >> PM_PAGE_SHIFT;
+    size_t node_idx = (page >> (2 * PM_LEVEL_BITS)) & LEVEL_MASK;
+    size_t leaf_idx = (page >> PM_LEVEL_BITS) & LEVEL_MASK;
+
+    PageMapNode* node = map->nodes[node_idx];
+    if (node == NULL) {
+        if (!create)
+            return NULL;
+
+        node = map_new(sizeof(PageMapNode));
+        if (node == MAP_FAILED)
+            exit(1);
+
+        map->nodes[node_idx] = node;
+    }
+
+    PageMapLeaf* leaf = node->leaves[leaf_idx];
+    if (leaf == NULL) {
+        if (!create)
+            return NULL;
+
+        // Fresh mappings are zeroed, which is an empty entry for every page
+        leaf = map_new(sizeof(PageMapLeaf));
+        if (leaf == MAP_FAILED)
+            exit(1);
+
+        node->leaves[leaf_idx] = leaf;
+    }
+
+    return &leaf->pages[page & LEVEL_MASK];
+}
+
+/*
+ * Makes room in the map for the pages of a new heap mapping, and widens the
+ * heap bounds to include it.
+ */
+void PM_map(PageMap* map, void* ptr, size_t size) {
+    uintptr_t start = (uintptr_t)ptr;
+    uintptr_t end = start + size;
+
+    for (uintptr_t addr = start; addr < end; addr += PM_PAGE_SIZE)
+        PM_entry(map, addr, true);
+
+    if (start < map->min)
+        map->min = start;
+    if (end > map->max)
+        map->max = end;
+}
+
+/*
+ * Records a block that has just been tagged: sets the bit for its tag and
+ * points every later page the block runs into back at it.
+ *
+ * This is proportional to the size of the block, which the caller has to
+ * zero anyway.
+ */
+void PM_add_block(PageMap* map, uint32_t block_idx, Block* header) {
+    uintptr_t tag = (uintptr_t)block_data(header) - sizeof(BlockTag);
+    uintptr_t end = (uintptr_t)header->ptr + header->size;
+
+    size_t granule = (tag & (PM_PAGE_SIZE - 1)) / ALIGNMENT;
+    PM_entry(map, tag, true)->starts[granule / 64] |= 1ull << (granule % 64);
+
+    uintptr_t page = (tag & ~(PM_PAGE_SIZE - 1)) + PM_PAGE_SIZE;
+    for (; page < end; page += PM_PAGE_SIZE)
+        PM_entry(map, page, true)->covering = block_idx + 1;
+}
+
+/*
+ * Forgets a block that is about to be freed, undoing `PM_add_block`.
+ */
+void PM_remove_block(PageMap* map, Block* header) {
+    uintptr_t tag = (uintptr_t)block_data(header) - sizeof(BlockTag);
+    uintptr_t end = (uintptr_t)header->ptr + header->size;
+
+    size_t granule = (tag & (PM_PAGE_SIZE - 1)) / ALIGNMENT;
+    PM_entry(map, tag, true)->starts[granule / 64] &= ~(1ull << (granule % 64));
+
+    uintptr_t page = (tag & ~(PM_PAGE_SIZE - 1)) + PM_PAGE_SIZE;
+    for (; page < end; page += PM_PAGE_SIZE)
+        PM_entry(map, page, true)->covering = 0;
+}
+
+/*
+ * Finds the used block that may own the memory at `ptr`: the closest block
+ * whose tag sits at or below `ptr` on the same page, or else the block
+ * running into the page.
+ *
+ * This is a constant number of steps no matter how large the heap is. The
+ * caller still has to check that `ptr` lies inside the returned block, since
+ * the closest block may end before it.
+ *
+ * Returns the index of the block in `NA.headers`, or `BLOCK_NONE`
+ */
+uint32_t PM_find(PageMap* map, void* ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr < map->min || addr >= map->max)
+        return BLOCK_NONE;
+
+    PageEntry* entry = PM_entry(map, addr, false);
+    if (entry == NULL)
+        return BLOCK_NONE;
+
+    size_t granule = (addr & (PM_PAGE_SIZE - 1)) / ALIGNMENT;
+    size_t word = granule / 64;
+    // Only the tags at or below `ptr`
+    uint64_t bits = entry->starts[word] & (~0ull >> (63 - granule % 64));
+
+    while (bits == 0 && word > 0)
+        bits = entry->starts[--word];
+
+    // `covering` is offset by one, so an empty entry gives `BLOCK_NONE`
+    if (bits == 0)
+        return entry->covering - 1;
+
+    size_t tag_granule = word * 64 + 63 - __builtin_clzll(bits);
+    BlockTag* tag = (BlockTag*)((addr & ~(PM_PAGE_SIZE - 1)) +
+                                tag_granule * ALIGNMENT);
+    if (tag->magic != BLOCK_MAGIC)
+        return BLOCK_NONE;
+
+    return tag->idx;
+}
+
+/*
+ * Dirties the card holding `ptr`, if `ptr` is inside the heap.
+ *
+ * Called by mutators without `NA.lock`, the levels of the tree are only ever
+ * added while they run, never removed
+ */
+void PM_dirty_card(PageMap* map, void* ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr < map->min || addr >= map->max)
+        return;
+
+    PageEntry* entry = PM_entry(map, addr, false);
+    if (entry != NULL)
+        entry->cards[(addr & (PM_PAGE_SIZE - 1)) >> PM_CARD_SHIFT] = 1;
+}
+
+/*
+ * Calls `visit` with the address of every dirty card, cleaning them along the
+ * way.
+ *
+ * `visit` - May be `NULL` to just clean every card
+ */
+void PM_take_dirty_cards(PageMap* map, void (*visit)(void* card)) {
+    for (size_t i = 0; i < PM_FANOUT; i++) {
+        PageMapNode* node = map->nodes[i];
+        if (node == NULL)
+            continue;
+
+        for (size_t j = 0; j < PM_FANOUT; j++) {
+            PageMapLeaf* leaf = node->leaves[j];
+            if (leaf == NULL)
+                continue;
+
+            for (size_t k = 0; k < PM_FANOUT; k++) {
+                PageEntry* entry = &leaf->pages[k];
+                uintptr_t page =
+                    ((i << (2 * PM_LEVEL_BITS)) | (j << PM_LEVEL_BITS) | k)
+                    << PM_PAGE_SHIFT;
+
+                for (size_t card = 0; card < PM_CARDS; card++) {
+                    if (!entry->cards[card])
+                        continue;
+
+                    entry->cards[card] = 0;
+                    if (visit != NULL)
+                        visit((void*)(page + card * PM_CARD_SIZE));
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Calls `visit` with the address of every page written to during the current
+ * incremental cycle, clearing them along the way.
+ */
+void PM_take_written_pages(PageMap* map, void (*visit)(void* page)) {
+    for (size_t i = 0; i < PM_FANOUT; i++) {
+        PageMapNode* node = map->nodes[i];
+        if (node == NULL)
+            continue;
+
+        for (size_t j = 0; j < PM_FANOUT; j++) {
+            PageMapLeaf* leaf = node->leaves[j];
+            if (leaf == NULL)
+                continue;
+
+            for (size_t k = 0; k < PM_FANOUT; k++) {
+                PageEntry* entry = &leaf->pages[k];
+                if (!entry->written)
+                    continue;
+
+                entry->written = 0;
+                visit((void*)(((i << (2 * PM_LEVEL_BITS)) |
+                               (j << PM_LEVEL_BITS) | k)
+                              << PM_PAGE_SHIFT));
+            }
+        }
+    }
+}
+
+/*
+ * Forgets the cards and written flags of memory that is about to be unmapped,
+ * so neither leads a collection back into it.
+ */
+void PM_unmap(PageMap* map, void* ptr, size_t size) {
+    uintptr_t start = (uintptr_t)ptr;
+
+    for (uintptr_t addr = start; addr < start + size; addr += PM_PAGE_SIZE) {
+        PageEntry* entry = PM_entry(map, addr, false);
+        if (entry == NULL)
+            continue;
+
+        memset(entry->cards, 0, sizeof(entry->cards));
+        entry->written = 0;
+    }
+}
+
+void PM_free(PageMap* map) {
+    for (size_t i = 0; i < PM_FANOUT; i++) {
+        PageMapNode* node = map->nodes[i];
+        if (node == NULL)
+            continue;
+
+        for (size_t j = 0; j < PM_FANOUT; j++) {
+            if (node->leaves[j] != NULL)
+                munmap(node->leaves[j], sizeof(PageMapLeaf));
+        }
+
+        munmap(node, sizeof(PageMapNode));
+    }
+
+    munmap(map->nodes, PM_FANOUT * sizeof(PageMapNode*));
+    map->nodes = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef NARSIRABAD_PM
+#define NARSIRABAD_PM
+
+#include "alloc.h"
+#include <stddef.h>
+
+/*
+ * `PageMap` functions
+ */
+
+PageMap PM_new();
+
+PageEntry* PM_entry(PageMap* map, uintptr_t addr, bool create);
+
+void PM_map(PageMap* map, void* ptr, size_t size);
+
+void PM_add_block(PageMap* map, uint32_t block_idx, Block* header);
+
+void PM_remove_block(PageMap* map, Block* header);
+
+uint32_t PM_find(PageMap* map, void* ptr);
+
+void PM_dirty_card(PageMap* map, void* ptr);
+
+void PM_take_dirty_cards(PageMap* map, void (*visit)(void* card));
+
+void PM_take_written_pages(PageMap* map, void (*visit)(void* page));
+
+void PM_unmap(PageMap* map, void* ptr, size_t size);
+
+void PM_free(PageMap* map);
+
+#endif
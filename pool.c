@@ -0,0 +1,238 @@
+#include "pool.h"
+#include "alloc.h"
+#include "bl.h"
+#include "gc.h"
+#include "mem.h"
+#include "pm.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define NA NARSIRABAD_ALLOCATOR
+#define NC NARSIRABAD_COLLECTOR
+
+extern Allocator NARSIRABAD_ALLOCATOR;
+extern Collector NARSIRABAD_COLLECTOR;
+
+/*
+ * Lays out a slab of `slab_size` bytes: its tag, its header and bitmaps, and
+ * then as many slots as fit.
+ *
+ * Returns the number of slots, and where the first one starts in `first`
+ */
+uint32_t slab_layout(Pool* pool, size_t slab_size, size_t* first) {
+    uint32_t count = slab_size / pool->size;
+
+    for (; count > 0; count--) {
+        size_t words = (count + 63) / 64;
+        size_t header = sizeof(BlockTag) + sizeof(PoolSlab) +
+                        3 * words * sizeof(uint64_t);
+
+        *first = (header + pool->align - 1) & ~(pool->align - 1);
+        if (*first + count * pool->size <= slab_size)
+            break;
+    }
+
+    return count;
+}
+
+/*
+ * Maps `size` bytes aligned to `size`, which is a power of two.
+ */
+void* map_slab(size_t size) {
+    if (size <= (size_t)getpagesize())
+        return map_new(size);
+
+    // Twice as much, trimmed down to the aligned part
+    uint8_t* mapping = map_new(2 * size);
+    if (mapping == MAP_FAILED)
+        return MAP_FAILED;
+
+    uint8_t* start =
+        (uint8_t*)(((uintptr_t)mapping + size - 1) & ~(uintptr_t)(size - 1));
+    if (start > mapping)
+        munmap(mapping, start - mapping);
+    munmap(start + size, mapping + size - start);
+
+    return start;
+}
+
+PoolSlab* slab_of(Pool* pool, void* ptr) {
+    uintptr_t slab = (uintptr_t)ptr & ~(uintptr_t)(pool->slab_size - 1);
+    return (PoolSlab*)(slab + sizeof(BlockTag));
+}
+
+/*
+ * Maps a new slab and puts all of its slots on the free list.
+ *
+ * The slab is tagged and added to the page map like any used block, so the
+ * collector finds the slab an object is in the same way.
+ */
+bool new_slab(Pool* pool) {
+    uint8_t* mapping = map_slab(pool->slab_size);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    // `mmap` zeroed the bitmaps
+    PoolSlab* slab = (PoolSlab*)(mapping + sizeof(BlockTag));
+    size_t words = (pool->count + 63) / 64;
+    slab->pool = pool;
+    slab->slots = mapping + pool->first;
+    slab->count = pool->count;
+    slab->allocated = (uint64_t*)(slab + 1);
+    slab->marks = slab->allocated + words;
+    slab->scanned = slab->marks + words;
+
+    // Lowest address first
+    void* free = pool->free;
+    for (uint32_t i = pool->count; i-- > 0;) {
+        void* slot = slab->slots + i * pool->size;
+        *(void**)slot = free;
+        free = slot;
+    }
+
+    pthread_mutex_lock(&NA.lock);
+
+    PM_map(&NA.page_map, mapping, pool->slab_size);
+    track_mapping(mapping, pool->slab_size);
+    __atomic_fetch_add(&NA.mapped, pool->slab_size, __ATOMIC_RELAXED);
+
+    uint32_t idx = BL_new_header(&NA.headers, pool->slab_size, mapping);
+    BL_idx(&NA.headers, idx)->flags = BLOCK_POOL;
+    count_block(BL_idx(&NA.headers, idx), true);
+
+    // A minor collection takes every pooled object to be old
+    ((BlockTag*)tag_block(idx) - 1)->young = false;
+
+    // Linked under the lock, so a collection sees either all of it or nothing
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    pthread_mutex_unlock(&NA.lock);
+
+    pool->free = free;
+    return true;
+}
+
+Pool* pool_create(size_t obj_size, size_t align) {
+    if (align < sizeof(uintptr_t))
+        align = sizeof(uintptr_t);
+    if ((align & (align - 1)) != 0 || align > POOL_SLAB_SIZE)
+        return NULL;
+
+    // The thread using the pool has to be scanned
+    gc_register_thread();
+
+    Pool* pool = map_new(sizeof(Pool));
+    if (pool == MAP_FAILED)
+        return NULL;
+
+    if (obj_size < sizeof(void*))
+        obj_size = sizeof(void*);
+
+    pool->size = (obj_size + align - 1) & ~(align - 1);
+    pool->align = align;
+    pool->slab_size = (size_t)getpagesize() > POOL_SLAB_SIZE ? getpagesize()
+                                                             : POOL_SLAB_SIZE;
+    while ((pool->count = slab_layout(pool, pool->slab_size, &pool->first)) <
+           POOL_MIN_SLOTS)
+        pool->slab_size *= 2;
+
+    pool->free = NULL;
+    pool->reclaimed = NULL;
+    pool->slabs = NULL;
+    pool->prev = NULL;
+
+    pthread_mutex_lock(&NA.lock);
+    pool->next = NA.pools;
+    if (NA.pools != NULL)
+        NA.pools->prev = pool;
+    NA.pools = pool;
+    pthread_mutex_unlock(&NA.lock);
+
+    return pool;
+}
+
+void* pool_alloc(Pool* pool) {
+    void* slot = pool->free;
+    if (slot == NULL) {
+        // Slots the collector took back come before a new slab
+        slot = __atomic_exchange_n(&pool->reclaimed, NULL, __ATOMIC_ACQUIRE);
+        if (slot == NULL) {
+            if (!new_slab(pool))
+                return NULL;
+
+            slot = pool->free;
+        }
+    }
+    pool->free = *(void**)slot;
+
+    // The collector may be stopping us at any point, so the bits are only
+    // ever changed atomically
+    PoolSlab* slab = slab_of(pool, slot);
+    size_t i = ((uint8_t*)slot - slab->slots) / pool->size;
+    uint64_t bit = 1ull << (i % 64);
+    __atomic_fetch_or(&slab->allocated[i / 64], bit, __ATOMIC_RELAXED);
+
+    // Handed out during an incremental cycle, so alive as far as it's concerned
+    if (NC.cycle_active)
+        __atomic_fetch_or(&slab->marks[i / 64], bit, __ATOMIC_RELAXED);
+
+    memset(slot, 0, pool->size);
+    return slot;
+}
+
+void pool_free(Pool* pool, void* ptr) {
+    if (ptr == NULL)
+        return;
+
+    PoolSlab* slab = slab_of(pool, ptr);
+    size_t i = ((uint8_t*)ptr - slab->slots) / pool->size;
+    uint64_t bit = 1ull << (i % 64);
+    if (!(__atomic_fetch_and(&slab->allocated[i / 64], ~bit,
+                             __ATOMIC_RELAXED) &
+          bit))
+        return;
+
+    *(void**)ptr = pool->free;
+    pool->free = ptr;
+}
+
+void pool_destroy(Pool* pool) {
+    pthread_mutex_lock(&NA.lock);
+
+    if (pool->prev != NULL)
+        pool->prev->next = pool->next;
+    else
+        NA.pools = pool->next;
+
+    if (pool->next != NULL)
+        pool->next->prev = pool->prev;
+
+    // A slab still queued by an incremental cycle is skipped once its header
+    // is vacant
+    for (PoolSlab* slab = pool->slabs; slab != NULL; slab = slab->next) {
+        BlockTag* tag = (BlockTag*)slab - 1;
+        Block* header = BL_idx(&NA.headers, tag->idx);
+
+        PM_remove_block(&NA.page_map, header);
+        PM_unmap(&NA.page_map, header->ptr, header->size);
+        count_block(header, false);
+        BL_drop_header(&NA.headers, tag->idx);
+        __atomic_fetch_sub(&NA.mapped, pool->slab_size, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&NA.lock);
+
+    PoolSlab* slab = pool->slabs;
+    while (slab != NULL) {
+        PoolSlab* next = slab->next;
+        munmap((BlockTag*)slab - 1, pool->slab_size);
+        slab = next;
+    }
+
+    munmap(pool, sizeof(Pool));
+}
@@ -0,0 +1,35 @@
+#ifndef NARSIRABAD_POOL
+#define NARSIRABAD_POOL
+
+#include "alloc.h"
+#include <stddef.h>
+
+/*
+ * `Pool` functions
+ *
+ * A pool belongs to the thread that created it, only mapping a new slab takes
+ * the allocator's lock. Pooled objects are collected like any other block once
+ * nothing points to them.
+ */
+
+/// Creates a pool of objects of `obj_size` bytes, each aligned to `align`
+///
+/// `align` must be a power of two no larger than `POOL_SLAB_SIZE`, anything
+/// below the size of a pointer is raised to it
+///
+/// Returns `NULL` if `align` is invalid or the pool could not be mapped
+Pool* pool_create(size_t obj_size, size_t align);
+
+/// Guarantees that the returned memory will be zeroed
+///
+/// Returns `NULL` if a new slab was needed and could not be mapped
+void* pool_alloc(Pool* pool);
+
+/// Puts an object back into the pool it came from, `NULL` and objects that
+/// are already free are ignored
+void pool_free(Pool* pool, void* ptr);
+
+/// Unmaps the pool and every slab it has, along with the objects in them
+void pool_destroy(Pool* pool);
+
+#endif
@@ -0,0 +1,243 @@
+// Drop-in replacements for the C library's allocator
+//
+// Built into `libnar-preload.so`, so that existing programs can be run on the
+// heap with `LD_PRELOAD`. Programs free what they allocate, so collections are
+// off and the heap only grows, unless `NARSIRABAD_GC=1` is set. Then blocks
+// the program leaked are reclaimed as well, but only what the collector scans
+// keeps a block alive: the heap, the stacks of the threads that used it, and
+// the data of the program and the libraries loaded with it. A program that
+// keeps pointers anywhere else, such as memory it maps itself, can't run with
+// collections on.
+#define _GNU_SOURCE
+
+#include "alloc.h"
+#include "gc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NA NARSIRABAD_ALLOCATOR
+#define NC NARSIRABAD_COLLECTOR
+
+extern Allocator NARSIRABAD_ALLOCATOR;
+extern Collector NARSIRABAD_COLLECTOR;
+
+extern __thread Mutator mutator;
+
+// Where the main thread's stack started, kept by the dynamic loader
+extern void* __libc_stack_end;
+
+// Memory handed out while the heap itself is being set up, which is never
+// freed. Every allocation is preceded by its size
+#define BOOTSTRAP_SIZE (16ul << 10)
+
+uint8_t bootstrap_heap[BOOTSTRAP_SIZE] __attribute__((aligned(ALIGNMENT)));
+size_t bootstrap_used;
+
+bool preload_ready;
+__thread bool setting_up;
+
+void* bootstrap_alloc(size_t size, size_t alignment) {
+    size_t used = __atomic_load_n(&bootstrap_used, __ATOMIC_RELAXED);
+    size_t start;
+
+    do {
+        start = (used + ALIGNMENT + alignment - 1) & ~(alignment - 1);
+        if (start > BOOTSTRAP_SIZE || size > BOOTSTRAP_SIZE - start)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&bootstrap_used, &used,
+                                          start + size, true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    *((size_t*)(bootstrap_heap + start) - 1) = size;
+    return bootstrap_heap + start;
+}
+
+bool is_bootstrap(void* ptr) {
+    return (uint8_t*)ptr >= bootstrap_heap &&
+           (uint8_t*)ptr < bootstrap_heap + BOOTSTRAP_SIZE;
+}
+
+/*
+ * Sets up the heap for the first call to come in, which may well be before
+ * `new_allocator` has run as a constructor.
+ *
+ * Anything allocated while this runs comes from `bootstrap_heap`
+ */
+void preload_init() {
+    setting_up = true;
+
+    new_allocator();
+
+    // Rather than wherever the first call happened to come from, everything
+    // `main` has on the stack is above that
+    mutator.bottom_of_stack = (uintptr_t)__libc_stack_end;
+
+    // Anything can still free into the heap while the process exits
+    NA.keep_at_exit = true;
+
+    const char* gc = getenv("NARSIRABAD_GC");
+    NC.disabled = gc == NULL || strcmp(gc, "1") != 0;
+
+    // The first collection would start the helpers with `NA.lock` held, and
+    // `pthread_create` allocates
+    __atomic_store_n(&preload_ready, true, __ATOMIC_RELEASE);
+    if (!NC.disabled)
+        start_workers();
+
+    setting_up = false;
+}
+
+/*
+ * Returns whether the heap can take the call, setting it up first if needed.
+ */
+bool heap_ready() {
+    if (setting_up)
+        return false;
+
+    if (!__atomic_load_n(&preload_ready, __ATOMIC_ACQUIRE))
+        preload_init();
+
+    return true;
+}
+
+/*
+ * Hands out `size` bytes aligned to `alignment`, a power of two.
+ *
+ * `zero` - Whether the memory has to be zeroed, only `calloc` promises that
+ */
+void* aligned_block(size_t alignment, size_t size, bool zero) {
+    if (alignment < ALIGNMENT)
+        alignment = ALIGNMENT;
+
+    if (!heap_ready())
+        return bootstrap_alloc(size, alignment);
+
+    if (size > UINT32_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void* ptr;
+    if (alignment > ALIGNMENT)
+        ptr = allocate_aligned(size, alignment);
+    else if (zero)
+        ptr = allocate(size);
+    else
+        ptr = allocate_uninit(size);
+
+    if (ptr == NULL)
+        errno = ENOMEM;
+
+    return ptr;
+}
+
+bool is_power_of_two(size_t n) { return n != 0 && (n & (n - 1)) == 0; }
+
+void* malloc(size_t size) { return aligned_block(ALIGNMENT, size, false); }
+
+void free(void* ptr) {
+    if (ptr == NULL || is_bootstrap(ptr))
+        return;
+
+    deallocate(ptr);
+}
+
+void* calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // The bootstrap heap is never handed out twice, so it's still zero
+    return aligned_block(ALIGNMENT, total, true);
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL)
+        return 0;
+
+    if (is_bootstrap(ptr))
+        return *((size_t*)ptr - 1);
+
+    return usable_size(ptr);
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL)
+        return malloc(size);
+
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    // Blocks are resized where they are, when there's room
+    if (!is_bootstrap(ptr)) {
+        if (size > UINT32_MAX) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        void* new_ptr = reallocate(ptr, size);
+        if (new_ptr == NULL)
+            errno = ENOMEM;
+
+        return new_ptr;
+    }
+
+    size_t old_size = malloc_usable_size(ptr);
+    if (size <= old_size)
+        return ptr;
+
+    void* new_ptr = malloc(size);
+    if (new_ptr == NULL)
+        return NULL;
+
+    memcpy(new_ptr, ptr, old_size);
+    free(ptr);
+
+    return new_ptr;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (!is_power_of_two(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return aligned_block(alignment, size, false);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** result, size_t alignment, size_t size) {
+    if (!is_power_of_two(alignment) || alignment % sizeof(void*) != 0)
+        return EINVAL;
+
+    void* ptr = aligned_block(alignment, size, false);
+    if (ptr == NULL)
+        return ENOMEM;
+
+    *result = ptr;
+    return 0;
+}
+
+void* valloc(size_t size) { return aligned_block(getpagesize(), size, false); }
+
+void* pvalloc(size_t size) {
+    size_t page_size = getpagesize();
+    if (size > SIZE_MAX - page_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return aligned_block(page_size, (size + page_size - 1) & ~(page_size - 1),
+                         false);
+}
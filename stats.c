@@ -0,0 +1,127 @@
+#include "stats.h"
+#include "alloc.h"
+#include "gc.h"
+#include "mem.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define NA NARSIRABAD_ALLOCATOR
+#define NC NARSIRABAD_COLLECTOR
+
+extern Allocator NARSIRABAD_ALLOCATOR;
+extern Collector NARSIRABAD_COLLECTOR;
+
+// Mapped rather than kept in the .bss, which every collection scans
+NarEvent* trace_ring;
+// The position of the next event, events wrap around the ring
+uint64_t trace_next;
+
+NarStats nar_stats() {
+    NarStats stats = {0};
+
+    pthread_mutex_lock(&NA.lock);
+
+    stats.bytes_free = NA.bytes_free;
+    stats.blocks_free = NA.blocks_free;
+    stats.bytes_large = NA.bytes_large;
+    stats.blocks_large = NA.blocks_large;
+
+    stats.bytes_purged = NA.purged;
+    stats.purges = NA.purges;
+
+    stats.allocations = NA.allocations;
+    stats.frees = NA.frees;
+    for (Mutator* m = NA.mutators; m != NULL; m = m->next) {
+        stats.allocations += __atomic_load_n(&m->allocations, __ATOMIC_RELAXED);
+        stats.frees += __atomic_load_n(&m->frees, __ATOMIC_RELAXED);
+        stats.bytes_cached +=
+            __atomic_load_n(&m->bytes_cached, __ATOMIC_RELAXED);
+        stats.blocks_cached +=
+            __atomic_load_n(&m->blocks_cached, __ATOMIC_RELAXED);
+    }
+
+    // Cached blocks are used blocks too, only taken out of the cache without
+    // the lock
+    stats.bytes_in_use = NA.bytes_used - stats.bytes_cached;
+    stats.blocks_in_use = NA.blocks_used - stats.blocks_cached;
+
+    stats.collections = NC.collections;
+    stats.minor_collections = NC.minor_collections;
+    stats.bytes_live = NC.heap_live;
+    stats.heap_goal = NC.heap_goal;
+    stats.pauses = NC.pauses;
+    stats.max_pause = NC.max_pause;
+    stats.total_pause = NC.total_pause;
+    memcpy(stats.phase_time, NC.phase_time, sizeof(stats.phase_time));
+    for (int i = 0; i < GC_MAX_WORKERS; i++) {
+        stats.bytes_scanned += NC.workers[i].bytes_scanned;
+        stats.bytes_skipped += NC.workers[i].bytes_skipped;
+    }
+
+    pthread_mutex_unlock(&NA.lock);
+
+    stats.bytes_mapped = __atomic_load_n(&NA.mapped, __ATOMIC_RELAXED);
+
+    return stats;
+}
+
+void nar_trace_init() {
+    NarEvent* ring = map_new(NAR_TRACE_CAP * sizeof(NarEvent));
+    if (ring != MAP_FAILED)
+        trace_ring = ring;
+}
+
+/*
+ * Claims the next slot of the ring and fills it in. The slot's `seq` is cleared
+ * while it's written, so a dump can tell a torn event apart.
+ */
+void nar_trace(uint32_t event, uint64_t a, uint64_t b) {
+    if (trace_ring == NULL)
+        return;
+
+    uint64_t seq = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    NarEvent* slot = &trace_ring[seq % NAR_TRACE_CAP];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->time = now_ns();
+    slot->thread = (uint64_t)pthread_self();
+    slot->event = event;
+    slot->a = a;
+    slot->b = b;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void nar_trace_dump() {
+    if (trace_ring == NULL)
+        return;
+
+    uint64_t end = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    uint64_t start = end > NAR_TRACE_CAP ? end - NAR_TRACE_CAP : 0;
+
+    for (uint64_t seq = start; seq < end; seq++) {
+        NarEvent* slot = &trace_ring[seq % NAR_TRACE_CAP];
+
+        NarEvent copy;
+        copy.seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        copy.time = slot->time;
+        copy.thread = slot->thread;
+        copy.event = slot->event;
+        copy.a = slot->a;
+        copy.b = slot->b;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // Overwritten or still being written since we started
+        if (copy.seq != seq + 1 ||
+            __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1)
+            continue;
+
+        printf("%lu %lu %lx %u 0x%lx 0x%lx\n", copy.seq, copy.time,
+               copy.thread, copy.event, copy.a, copy.b);
+    }
+}
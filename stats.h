@@ -0,0 +1,97 @@
+#ifndef NARSIRABAD_STATS
+#define NARSIRABAD_STATS
+
+#include "gc.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    // Memory mapped for the heap, pool slabs and arena chunks
+    size_t bytes_mapped;
+    // Blocks handed out, pool slabs count as a whole
+    size_t bytes_in_use;
+    size_t blocks_in_use;
+    // The part of the above in large blocks, each mapped on its own
+    size_t bytes_large;
+    size_t blocks_large;
+    // Blocks sitting in thread caches, ready to be handed out again
+    size_t bytes_cached;
+    size_t blocks_cached;
+    size_t bytes_free;
+    size_t blocks_free;
+    // Bytes of free blocks handed back to the kernel, and the calls that did
+    size_t bytes_purged;
+    uint64_t purges;
+
+    // Calls to `allocate`, and blocks freed through `deallocate`
+    uint64_t allocations;
+    uint64_t frees;
+
+    uint64_t collections;
+    uint64_t minor_collections;
+    // Bytes the last collection left in use, and the heap in use at which the
+    // next full one is due, see Pacing in `gc.h`
+    size_t bytes_live;
+    size_t heap_goal;
+    // In nanoseconds, see `Collector`
+    uint64_t pauses;
+    uint64_t max_pause;
+    uint64_t total_pause;
+    uint64_t phase_time[GC_TIMES];
+    // Bytes of block data the collector scanned for pointers, and bytes it
+    // kept alive without scanning, see `allocate_atomic` and `allocate_typed`
+    uint64_t bytes_scanned;
+    uint64_t bytes_skipped;
+} NarStats;
+
+/// Takes a snapshot of what the allocator and collector have done so far
+///
+/// Only reads counters kept as things happen, so it's cheap enough to call at
+/// any time. Blocks other threads move in and out of their caches meanwhile may
+/// be counted on either side
+NarStats nar_stats();
+
+// Tracing
+//
+// Builds with `NARSIRABAD_TRACE` defined record events at the trace points
+// below into a ring buffer of the last `NAR_TRACE_CAP` events, without taking
+// any lock. Without it, the trace points compile to nothing.
+#define NAR_TRACE_CAP (1 << 16)
+
+// `NarEvent.event`, along with what `a` and `b` hold
+#define NAR_EVENT_ALLOCATE 1 // pointer, size
+#define NAR_EVENT_FREE 2     // pointer
+#define NAR_EVENT_EXPAND 3   // mapping, size
+#define NAR_EVENT_COLLECT 4  // whether it was minor, pause
+#define NAR_EVENT_CYCLE_START 5  // epoch, pause
+#define NAR_EVENT_CYCLE_FINISH 6 // epoch, pause
+#define NAR_EVENT_PURGE 7        // bytes, blocks
+
+typedef struct {
+    // The position of the event in the ring + 1, `0` while it's being written
+    uint64_t seq;
+    uint64_t time;
+    uint64_t thread;
+    uint32_t event;
+    uint64_t a;
+    uint64_t b;
+} NarEvent;
+
+#ifdef NARSIRABAD_TRACE
+#define NAR_TRACE(event, a, b) nar_trace(event, (uint64_t)(a), (uint64_t)(b))
+#else
+#define NAR_TRACE(event, a, b) ((void)0)
+#endif
+
+// Maps the ring buffer, events before then are dropped
+void nar_trace_init();
+
+// Records an event, safe to call with the world stopped
+void nar_trace(uint32_t event, uint64_t a, uint64_t b);
+
+/// Prints the events still in the ring buffer, oldest first
+///
+/// Does nothing in builds without `NARSIRABAD_TRACE`
+void nar_trace_dump();
+
+#endif
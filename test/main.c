@@ -1,8 +1,16 @@
 #include "../alloc.h"
+#include "../arena.h"
+#include "../bl.h"
+#include "../gc.h"
+#include "../pool.h"
+#include "../stats.h"
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 void allocate_lots() {
     int* b = allocate(100 * sizeof(int));
@@ -52,7 +60,7 @@ void no_reuse_test() {
 }
 
 void reuse_test() {
-    // This buffer should represent 4 integers
+    // This buffer should represent 10 integers
     int* b = allocate(10 * sizeof(int));
     if (b == NULL) {
         printf("Failed to allocate block of size %d", 128);
@@ -65,8 +73,9 @@ void reuse_test() {
 
     deallocate(b);
 
-    // This buffer should represent 4 integers
-    int* c = allocate(4 * sizeof(int));
+    // This buffer should represent 10 integers, the same size class as `b`, so
+    // it is served from the block `b` left in this thread's cache
+    int* c = allocate(10 * sizeof(int));
     if (c == NULL) {
         printf("Failed to allocate block of size %d", 10 * 8);
         exit(1);
@@ -85,8 +94,824 @@ void reuse_test() {
     puts("");
 }
 
+void size_class_test() {
+    // Three neighbouring blocks of the same size class, so the middle one
+    // can't merge with anything once it's freed
+    int* a = allocate(12 * sizeof(int));
+    int* b = allocate(12 * sizeof(int));
+    int* c = allocate(12 * sizeof(int));
+    assert(a != NULL && b != NULL && c != NULL);
+
+    deallocate(b);
+
+    // Should be served straight from the bin `b` was put in
+    int* d = allocate(12 * sizeof(int));
+    assert(d == b);
+    assert(d[11] == 0);
+
+    deallocate(a);
+    deallocate(c);
+    deallocate(d);
+
+    puts("");
+}
+
+void merge_test() {
+    // Large enough to skip the thread caches and go straight back to the heap
+    int* a = allocate(200 * sizeof(int));
+    int* b = allocate(200 * sizeof(int));
+    int* c = allocate(200 * sizeof(int));
+    assert(a != NULL && b != NULL && c != NULL);
+
+    deallocate(a);
+    deallocate(b);
+    // Freeing twice must not put the block back into a bin a second time
+    deallocate(b);
+
+    // `a` and `b` were merged, so the combined space can be handed out again
+    int* d = allocate(400 * sizeof(int));
+    assert(d == a);
+
+    deallocate(c);
+    deallocate(d);
+
+    puts("");
+}
+
+void reallocate_test() {
+    // Large enough to skip the thread caches, `b` sits right after `a`
+    int* a = allocate(200 * sizeof(int));
+    int* b = allocate(200 * sizeof(int));
+    int* c = allocate(200 * sizeof(int));
+    assert(a != NULL && b != NULL && c != NULL);
+
+    for (int i = 0; i < 200; i++)
+        a[i] = i;
+
+    // Shrinking never moves a block
+    assert(reallocate(a, 100 * sizeof(int)) == a);
+    assert(a[99] == 99);
+
+    // Grows back over the space it just gave up, and then into `b`
+    deallocate(b);
+    assert(reallocate(a, 300 * sizeof(int)) == a);
+    for (int i = 0; i < 100; i++)
+        assert(a[i] == i);
+    for (int i = 100; i < 300; i++)
+        assert(a[i] == 0);
+
+    // `c` is in the way now, so the block is copied somewhere else
+    int* d = reallocate(a, 800 * sizeof(int));
+    assert(d != NULL && d != a);
+    assert(d[99] == 99 && d[100] == 0 && d[799] == 0);
+
+    // A block with a mapping to itself keeps its contents when it is remapped
+    size_t size = 1 << 20;
+    unsigned char* e = allocate(size);
+    assert(e != NULL);
+    memset(e, 5, size);
+
+    e = reallocate(e, 4 * size);
+    assert(e != NULL);
+    assert(e[0] == 5 && e[size - 1] == 5);
+    assert(e[size] == 0 && e[4 * size - 1] == 0);
+
+    assert(reallocate(NULL, 10) != NULL);
+    int not_a_block[8] = {0};
+    assert(reallocate(&not_a_block[4], 10) == NULL);
+
+    deallocate(c);
+    deallocate(d);
+    deallocate(e);
+
+    puts("");
+}
+
+void aligned_test() {
+    size_t alignments[] = {16, 32, 64, 256, 4096, 1 << 16};
+    uint32_t sizes[] = {1, 100, 5000, 1 << 20};
+
+    for (int i = 0; i < sizeof(alignments) / sizeof(size_t); i++) {
+        for (int j = 0; j < sizeof(sizes) / sizeof(uint32_t); j++) {
+            unsigned char* a = allocate_aligned(sizes[j], alignments[i]);
+            assert(a != NULL);
+            assert((uintptr_t)a % alignments[i] == 0);
+            assert(usable_size(a) >= sizes[j]);
+
+            for (uint32_t k = 0; k < sizes[j]; k++)
+                assert(a[k] == 0);
+            memset(a, 1, sizes[j]);
+
+            deallocate(a);
+        }
+    }
+
+    // Two in a row each skip to an address of their own
+    int* a = allocate_aligned(100, 4096);
+    int* b = allocate_aligned(100, 4096);
+    assert(a != NULL && b != NULL);
+    assert((uintptr_t)a % 4096 == 0 && (uintptr_t)b % 4096 == 0);
+    deallocate(a);
+    deallocate(b);
+
+    assert(allocate_aligned(10, 0) == NULL);
+    assert(allocate_aligned(10, 48) == NULL);
+
+    puts("");
+}
+
+void uninit_test() {
+    // Both small enough for the thread cache and too large for it
+    uint32_t sizes[] = {40, 3000};
+
+    for (int i = 0; i < sizeof(sizes) / sizeof(uint32_t); i++) {
+        uint32_t size = sizes[i];
+
+        unsigned char* a = allocate(size);
+        assert(a != NULL);
+        size_t usable = usable_size(a);
+        memset(a, 0xff, usable);
+        deallocate(a);
+
+        // Gets the same block back, dirty where it was asked for and zeroed
+        // past that
+        unsigned char* b = allocate_uninit(size);
+        assert(b == a);
+        assert(usable_size(b) == usable);
+        for (size_t j = size; j < usable; j++)
+            assert(b[j] == 0);
+
+        memset(b, 0xff, usable);
+        deallocate(b);
+
+        unsigned char* c = allocate(size);
+        assert(c == a);
+        for (size_t j = 0; j < usable; j++)
+            assert(c[j] == 0);
+
+        deallocate(c);
+    }
+
+    puts("");
+}
+
+void interior_pointer_test() {
+    int* a = allocate(64 * sizeof(int));
+    assert(a != NULL);
+    a[10] = 7;
+
+    // Only a pointer into the middle of the block is left
+    int* interior = a + 10;
+    a = NULL;
+
+    garbage_collect();
+
+    int* b = allocate(64 * sizeof(int));
+    assert(b != interior - 10);
+    assert(*interior == 7);
+
+    deallocate(b);
+    deallocate(interior - 10);
+
+    puts("");
+}
+
+typedef struct Node {
+    struct Node* next;
+    int value;
+} Node;
+
+void cyclic_list_test() {
+    Node* head = NULL;
+    Node* tail = NULL;
+    for (int i = 0; i < 50; i++) {
+        Node* node = allocate(sizeof(Node));
+        assert(node != NULL);
+
+        node->next = head;
+        node->value = i;
+        head = node;
+
+        if (tail == NULL)
+            tail = node;
+    }
+    // Close the cycle, marking must still terminate
+    tail->next = head;
+    tail = NULL;
+
+    garbage_collect();
+
+    // Anything collected by mistake would be handed out again here
+    for (int i = 0; i < 50; i++) {
+        Node* node = allocate(sizeof(Node));
+        assert(node != NULL);
+        node->value = -1;
+    }
+
+    Node* node = head;
+    for (int i = 49; i >= 0; i--) {
+        assert(node->value == i);
+        node = node->next;
+    }
+    assert(node == head);
+
+    puts("");
+}
+
+void wide_graph_test() {
+    // Nothing collects before we do, the heap grows instead
+    gc_disable();
+
+    // More children than fit in a mark deque, the ones that don't fit have to
+    // be found by rescanning
+    int count = MARK_DEQUE_CAP + 4096;
+    int** parent = allocate(count * sizeof(int*));
+    assert(parent != NULL);
+
+    for (int i = 0; i < count; i++) {
+        parent[i] = allocate(sizeof(int));
+        *parent[i] = i;
+    }
+
+    gc_enable();
+    garbage_collect();
+
+    // Anything collected by mistake would be handed out again here
+    for (int i = 0; i < count; i++)
+        *(int*)allocate(sizeof(int)) = -1;
+
+    for (int i = 0; i < count; i++)
+        assert(*parent[i] == i);
+
+    puts("");
+}
+
+// Keeps the nodes out of the caller's frame, so only the arena points to them
+__attribute__((noinline)) void fill_arena(Arena* arena, Node*** slots,
+                                          int count) {
+    for (int i = 0; i < count; i++) {
+        slots[i] = arena_alloc(arena, sizeof(Node*));
+        assert(slots[i] != NULL && *slots[i] == NULL);
+
+        *slots[i] = allocate(sizeof(Node));
+        (*slots[i])->value = i;
+    }
+}
+
+void arena_test() {
+    // Small chunks, the slots span a lot of them
+    Arena* arena = arena_create(4096, true);
+    assert(arena != NULL);
+
+    int count = 2048;
+    Node*** slots = malloc(count * sizeof(Node**));
+    fill_arena(arena, slots, count);
+
+    garbage_collect();
+
+    // Anything collected by mistake would be handed out again here
+    for (int i = 0; i < count; i++)
+        ((Node*)allocate(sizeof(Node)))->value = -1;
+
+    for (int i = 0; i < count; i++)
+        assert((*slots[i])->value == i);
+
+    // Chunks are reused after a reset, and come back zeroed
+    arena_reset(arena);
+    assert(arena_alloc(arena, 1) == slots[0]);
+    for (int i = 1; i < count; i++)
+        assert(arena_alloc(arena, sizeof(Node*)) == slots[i] && *slots[i] == NULL);
+
+    // Larger than a chunk
+    uint8_t* large = arena_alloc(arena, 3 * 4096);
+    assert(large != NULL && large[3 * 4096 - 1] == 0);
+
+    // Would wrap around once rounded up
+    assert(arena_alloc(arena, SIZE_MAX - 1) == NULL);
+
+    free(slots);
+    arena_destroy(arena);
+
+    puts("");
+}
+
+size_t count_slabs(Pool* pool) {
+    size_t count = 0;
+    for (PoolSlab* slab = pool->slabs; slab != NULL; slab = slab->next)
+        count++;
+
+    return count;
+}
+
+// Keeps the garbage out of the caller's frame
+__attribute__((noinline)) void fill_pool(Pool* pool, int count) {
+    for (int i = 0; i < count; i++)
+        ((Node*)pool_alloc(pool))->value = -1;
+}
+
+void pool_test() {
+    Pool* pool = pool_create(sizeof(Node), 0);
+    assert(pool != NULL);
+
+    // A list of pooled nodes, ending in a block from the heap
+    int count = 2048;
+    Node* tail = allocate(sizeof(Node));
+    tail->value = count;
+
+    Node* head = tail;
+    for (int i = count - 1; i >= 0; i--) {
+        Node* node = pool_alloc(pool);
+        assert(node != NULL && node->next == NULL);
+
+        node->next = head;
+        node->value = i;
+        head = node;
+    }
+
+    fill_pool(pool, 2 * count);
+    size_t slabs = count_slabs(pool);
+
+    garbage_collect();
+
+    // The garbage is handed out again instead of new slabs
+    for (int i = 0; i < count; i++)
+        ((Node*)pool_alloc(pool))->value = -1;
+    assert(count_slabs(pool) == slabs);
+
+    for (int i = 0; i < count; i++)
+        ((Node*)allocate(sizeof(Node)))->value = -1;
+
+    Node* node = head;
+    for (int i = 0; i <= count; i++) {
+        assert(node->value == i);
+        node = node->next;
+    }
+    assert(node == NULL);
+
+    // Freed objects are reused first
+    Node* first = head->next;
+    head->next = NULL;
+    pool_free(pool, first);
+    assert(pool_alloc(pool) == first);
+
+    pool_destroy(pool);
+
+    Pool* aligned = pool_create(48, 64);
+    for (int i = 0; i < 256; i++)
+        assert((uintptr_t)pool_alloc(aligned) % 64 == 0);
+    pool_destroy(aligned);
+
+    assert(pool_create(16, 24) == NULL);
+
+    puts("");
+}
+
+extern Allocator NARSIRABAD_ALLOCATOR;
+
+/*
+ * Checks the byte and block counts `nar_stats` keeps against a walk of every
+ * header, which is how they'd be taken otherwise.
+ */
+void check_block_counts() {
+    NarStats stats = nar_stats();
+    NarStats walked = {0};
+
+    BlockList* headers = &NARSIRABAD_ALLOCATOR.headers;
+    for (uint32_t i = 0; i < headers->len; i++) {
+        Block* header = BL_idx(headers, i);
+        if (header->ptr == NULL)
+            continue;
+
+        if (header->flags & BLOCK_LARGE) {
+            walked.bytes_large += header->size;
+            walked.blocks_large++;
+        }
+
+        if (is_free(header)) {
+            walked.bytes_free += header->size;
+            walked.blocks_free++;
+        } else if (((BlockTag*)block_data(header) - 1)->cached) {
+            walked.bytes_cached += header->size;
+            walked.blocks_cached++;
+        } else {
+            walked.bytes_in_use += header->size;
+            walked.blocks_in_use++;
+        }
+    }
+
+    assert(stats.bytes_free == walked.bytes_free);
+    assert(stats.blocks_free == walked.blocks_free);
+    assert(stats.bytes_cached == walked.bytes_cached);
+    assert(stats.blocks_cached == walked.blocks_cached);
+    assert(stats.bytes_in_use == walked.bytes_in_use);
+    assert(stats.blocks_in_use == walked.blocks_in_use);
+    assert(stats.bytes_large == walked.bytes_large);
+    assert(stats.blocks_large == walked.blocks_large);
+}
+
+void stats_test() {
+    int* live = allocate(4096);
+    *live = 1;
+
+    NarStats before = nar_stats();
+
+    void* ptrs[100];
+    for (int i = 0; i < 100; i++)
+        ptrs[i] = allocate(32 + i * 16);
+    for (int i = 0; i < 100; i++)
+        deallocate(ptrs[i]);
+
+    // Not handed out, so not counted
+    deallocate(&before);
+
+    garbage_collect();
+
+    NarStats after = nar_stats();
+    assert(after.allocations - before.allocations == 100);
+    assert(after.frees - before.frees == 100);
+    assert(after.collections == before.collections + 1);
+    assert(after.total_pause > before.total_pause);
+    assert(after.phase_time[GC_TIME_MARK] > before.phase_time[GC_TIME_MARK]);
+
+    assert(after.bytes_in_use >= 4096 && *live == 1);
+    assert(after.bytes_in_use + after.bytes_cached + after.bytes_free <=
+           after.bytes_mapped);
+    check_block_counts();
+
+    puts("");
+}
+
+void allocate_large_garbage() {
+    for (int i = 0; i < 8; i++) {
+        unsigned char* garbage = allocate(4 * LARGE_OBJECT_SIZE);
+        assert(garbage != NULL);
+        garbage[0] = 1;
+    }
+}
+
+void large_test() {
+    NarStats before = nar_stats();
+
+    size_t size = 2 * LARGE_OBJECT_SIZE;
+    unsigned char* a = allocate(size);
+    assert(a != NULL);
+    // Right after the tag at the start of its own mapping
+    assert((uintptr_t)a % getpagesize() == sizeof(BlockTag));
+    memset(a, 1, size);
+
+    NarStats after = nar_stats();
+    assert(after.blocks_large == before.blocks_large + 1);
+    assert(after.bytes_mapped - before.bytes_mapped >= size);
+
+    // Resized by remapping and unmapping its pages
+    a = reallocate(a, 2 * size);
+    assert(a != NULL && a[size - 1] == 1 && a[size] == 0);
+    a = reallocate(a, size / 2);
+    assert(a != NULL && a[size / 2 - 1] == 1);
+    assert(usable_size(a) < size);
+
+    deallocate(a);
+    // Unmapped already, so this must not look at it
+    deallocate(a);
+    // The garbage below may well be mapped where `a` was
+    a = NULL;
+
+    after = nar_stats();
+    assert(after.blocks_large == before.blocks_large);
+    assert(after.bytes_mapped == before.bytes_mapped);
+
+    // The last one may still be found on the stack, the rest are unmapped
+    allocate_large_garbage();
+    garbage_collect();
+    assert(nar_stats().blocks_large <= before.blocks_large + 1);
+
+    puts("");
+}
+
+void reserve_test() {
+    Allocator* na = &NARSIRABAD_ALLOCATOR;
+    assert(na->reserved != NULL);
+
+    use_huge_pages(true);
+
+    // Enough to grow the heap a few times, every mapping comes from the
+    // reserved range
+    void* blocks[64];
+    for (int i = 0; i < 64; i++) {
+        blocks[i] = allocate(LARGE_OBJECT_SIZE / 2);
+        assert(blocks[i] != NULL);
+
+        uint8_t* ptr = blocks[i];
+        assert(ptr >= na->reserved && ptr < na->reserved + na->committed);
+    }
+
+    for (int i = 0; i < 64; i++)
+        deallocate(blocks[i]);
+
+    use_huge_pages(false);
+
+    puts("");
+}
+
+void purge_test() {
+    // Purged as a free block rather than unmapped as a large one
+    size_t size = LARGE_OBJECT_SIZE / 2;
+    size_t page_size = getpagesize();
+
+    unsigned char* a = allocate(size);
+    assert(a != NULL);
+    memset(a, 1, size);
+    deallocate(a);
+
+    NarStats before = nar_stats();
+    purge_free_memory();
+    NarStats after = nar_stats();
+    assert(after.bytes_purged - before.bytes_purged >= size - 2 * page_size);
+    assert(after.purges > before.purges);
+
+    // The pages in the middle are gone until they're touched again
+    unsigned char resident;
+    void* page = (void*)(((uintptr_t)a + size / 2) & ~(page_size - 1));
+    assert(mincore(page, page_size, &resident) == 0);
+    assert(!(resident & 1));
+
+    unsigned char* b = allocate(size);
+    assert(b != NULL);
+    for (size_t i = 0; i < size; i++)
+        assert(b[i] == 0);
+    memset(b, 1, size);
+    deallocate(b);
+
+    // Without a decay, the next trip through the lock purges what was just
+    // freed
+    set_purge_decay(0);
+    before = nar_stats();
+    deallocate(allocate(size));
+    after = nar_stats();
+    assert(after.bytes_purged - before.bytes_purged >= size - 2 * page_size);
+    set_purge_decay(PURGE_DECAY);
+
+    puts("");
+}
+
+/*
+ * Allocates a block that only `*slot` points to, and returns its address
+ * hidden from the collector as `~ptr`.
+ */
+__attribute__((noinline)) uintptr_t hide_block(uintptr_t* slot) {
+    void* block = allocate(3000);
+    assert(block != NULL);
+
+    *slot = (uintptr_t)block;
+    return ~(uintptr_t)block;
+}
+
+/*
+ * Whether the block `hide_block` hid as `hidden` is still handed out. Kept out
+ * of line so the caller never holds the unhidden address.
+ */
+__attribute__((noinline)) bool block_alive(uintptr_t hidden) {
+    BlockTag* tag = (BlockTag*)~hidden - 1;
+    Block* header = BL_idx(&NARSIRABAD_ALLOCATOR.headers, tag->idx);
+    return header->ptr == (uint8_t*)tag && !is_free(header);
+}
+
+void atomic_test() {
+    NarStats before = nar_stats();
+
+    uintptr_t* buf = allocate_atomic(4096);
+    assert(buf != NULL);
+    // The only pointer to another block
+    uintptr_t hidden = hide_block(&buf[0]);
+    buf[1] = 42;
+    // Scanned as usual
+    uintptr_t** holder = allocate(64);
+    *holder = buf;
+
+    garbage_collect();
+
+    // The buffer is kept, but what it points to isn't
+    NarStats after = nar_stats();
+    assert(after.bytes_skipped >= before.bytes_skipped + 4096);
+    assert(after.bytes_scanned > before.bytes_scanned);
+    assert(*holder == buf && buf[0] == ~hidden && buf[1] == 42);
+    assert(!block_alive(hidden));
+    deallocate(holder);
+
+    // Still atomic once it's moved
+    buf = reallocate(buf, 64 << 10);
+    assert(buf != NULL && buf[1] == 42);
+    assert(((BlockTag*)buf - 1)->atomic);
+
+    deallocate(buf);
+
+    puts("");
+}
+
+// In the .bss, where a collection has to find it
+uintptr_t static_root;
+
+void roots_test() {
+    uintptr_t hidden = hide_block(&static_root);
+    garbage_collect();
+    assert(block_alive(hidden));
+
+    // Excluded, so the block only it points to goes
+    gc_remove_roots(&static_root, &static_root + 1);
+    garbage_collect();
+    assert(!block_alive(hidden));
+    static_root = 0;
+    gc_add_roots(&static_root, &static_root + 1);
+
+    // Memory of our own is only scanned once it's added
+    uintptr_t* mapping = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(mapping != MAP_FAILED);
+
+    gc_add_roots(mapping, mapping + 16);
+    hidden = hide_block(&mapping[3]);
+    garbage_collect();
+    assert(block_alive(hidden));
+
+    gc_remove_roots(mapping, (uint8_t*)mapping + getpagesize());
+    garbage_collect();
+    assert(!block_alive(hidden));
+
+    munmap(mapping, getpagesize());
+
+    puts("");
+}
+
+typedef struct Record {
+    struct Record* next;
+    uintptr_t id;
+    char name[48];
+} Record;
+
+void typed_test() {
+    size_t offsets[] = {offsetof(Record, next)};
+    uint16_t layout = register_layout(sizeof(Record), offsets, 1);
+    assert(layout != 0);
+
+    size_t unaligned[] = {offsetof(Record, name) + 1};
+    assert(register_layout(sizeof(Record), unaligned, 1) == 0);
+    assert(register_layout(sizeof(Record) - 1, offsets, 1) == 0);
+    assert(allocate_typed(sizeof(Record), 0) == NULL);
+    assert(allocate_typed(sizeof(Record), layout + 100) == NULL);
+
+    NarStats before = nar_stats();
+
+    Record* records = allocate_typed(4 * sizeof(Record), layout);
+    assert(records != NULL);
+    // Through a field the layout scans, and through a scalar
+    records[2].next = allocate(sizeof(Record));
+    records[2].next->id = 7;
+    uintptr_t hidden = hide_block(&records[1].id);
+
+    garbage_collect();
+
+    // Reached through `next`, but not through `id`
+    NarStats after = nar_stats();
+    assert(after.bytes_skipped > before.bytes_skipped);
+    assert(records[2].next->id == 7 && records[1].id == ~hidden);
+    assert(block_alive(~(uintptr_t)records[2].next));
+    assert(!block_alive(hidden));
+
+    deallocate(records[2].next);
+    deallocate(records);
+
+    puts("");
+}
+
+extern Collector NARSIRABAD_COLLECTOR;
+
+/*
+ * Allocates `bytes` in blocks of `size` nothing points to, each too large for
+ * the thread cache.
+ */
+void allocate_garbage(size_t bytes, uint32_t size) {
+    for (size_t i = 0; i < bytes; i += size) {
+        unsigned char* garbage = allocate(size);
+        assert(garbage != NULL);
+        garbage[0] = 1;
+    }
+}
+
+void pacing_test() {
+    // Whatever the environment asked for
+    set_gc_percent(GC_PERCENT);
+    set_memory_limit(0);
+
+    garbage_collect();
+    NarStats before = nar_stats();
+    assert(before.heap_goal >= GC_MIN_HEAP);
+    assert(before.heap_goal >= 2 * before.bytes_live);
+
+    // Collected once the heap reaches the goal, not once it runs out of room
+    allocate_garbage(before.heap_goal, 1000);
+    NarStats after = nar_stats();
+    assert(after.collections > before.collections);
+
+    // Put off while disabled, and caught up on once enabled again
+    before = after;
+    gc_disable();
+    gc_disable();
+    allocate_garbage(before.heap_goal, 1000);
+    gc_enable();
+    assert(nar_stats().collections == before.collections);
+    gc_enable();
+    assert(nar_stats().collections == before.collections + 1);
+
+    // Large blocks are paced the same way, and never collected for when off
+    set_gc_percent(-1);
+    before = nar_stats();
+    assert(before.heap_goal == SIZE_MAX);
+    allocate_garbage(64 << 20, 1 << 20);
+    assert(nar_stats().collections == before.collections);
+
+    // Enough alive that the percentage sets the goal, rather than the minimum
+    void* kept = allocate(8 << 20);
+    assert(kept != NULL);
+
+    uint64_t paced[2];
+    int percents[] = {GC_PERCENT, 10 * GC_PERCENT};
+    for (int i = 0; i < 2; i++) {
+        set_gc_percent(percents[i]);
+        garbage_collect();
+        before = nar_stats();
+        allocate_garbage(64 << 20, 1 << 20);
+        paced[i] = nar_stats().collections - before.collections;
+    }
+    assert(paced[0] > paced[1]);
+    deallocate(kept);
+    set_gc_percent(GC_PERCENT);
+
+    // Far below what's alive, collections still leave some room in between
+    set_memory_limit(1);
+    before = nar_stats();
+    allocate_garbage(4 * GC_LIMIT_HEADROOM, 1000);
+    after = nar_stats();
+    assert(after.collections >= before.collections + 2);
+    assert(after.collections <= before.collections + 5);
+    set_memory_limit(0);
+
+    puts("");
+}
+
+void generational_test() {
+    gc_enable_generational();
+
+    Node* old = allocate(sizeof(Node));
+    old->value = -1;
+    // Survives and is promoted
+    garbage_collect();
+
+    uint64_t minor_collections = NARSIRABAD_COLLECTOR.minor_collections;
+
+    // Enough garbage to run out of a few nurseries
+    int count = 3 * NURSERY_SIZE / (sizeof(Node) + sizeof(BlockTag));
+    for (int i = 0; i < count; i++) {
+        Node* young = allocate(sizeof(Node));
+        young->value = i;
+
+        // Only the old node points to it, through its dirty card
+        if (i == 1000)
+            GC_WRITE(old->next, young);
+    }
+
+    assert(NARSIRABAD_COLLECTOR.minor_collections > minor_collections);
+
+    // Freeing a block clears its tag
+    assert(((BlockTag*)old->next - 1)->magic == BLOCK_MAGIC);
+    assert(old->next->value == 1000);
+
+    puts("");
+}
+
 int main() {
     no_reuse_test();
     reuse_test();
+    size_class_test();
+    merge_test();
+    reallocate_test();
+    aligned_test();
+    uninit_test();
+    interior_pointer_test();
+    cyclic_list_test();
     gc_test();
+    wide_graph_test();
+    arena_test();
+    pool_test();
+    stats_test();
+    large_test();
+    reserve_test();
+    purge_test();
+    atomic_test();
+    typed_test();
+    roots_test();
+    pacing_test();
+    generational_test();
+
+    // Kept up to date through everything above
+    check_block_counts();
 }
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include "../alloc.h"
+#include "../gc.h"
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Built together with `preload.c`, which takes over `malloc` for the whole
+// program, the C library's own allocations included
+
+#define THREADS 8
+#define ITERATIONS 20000
+#define SLOTS 64
+#define FORKS 20
+
+volatile bool running;
+
+void basics_test() {
+    printf("Begin Basics Test\n");
+
+    char* a = malloc(100);
+    assert(a != NULL);
+    assert((uintptr_t)a % 16 == 0);
+    // It's one of our blocks
+    assert(usable_size(a) >= 100);
+    assert(malloc_usable_size(a) >= 100);
+    memset(a, 1, 100);
+
+    int* b = calloc(1000, sizeof(int));
+    assert(b != NULL);
+    for (int i = 0; i < 1000; i++)
+        assert(b[i] == 0);
+
+    // Kept from the compiler, which would reject the calls
+    volatile size_t huge = SIZE_MAX / 2;
+    errno = 0;
+    assert(calloc(huge, 4) == NULL);
+    assert(errno == ENOMEM);
+    assert(malloc((size_t)UINT32_MAX + 1) == NULL);
+
+    // Allocated inside the C library
+    char* copy = strdup("narsirabad");
+    assert(usable_size(copy) >= 11);
+    assert(strcmp(copy, "narsirabad") == 0);
+
+    free(copy);
+    free(b);
+    free(a);
+    free(NULL);
+}
+
+void realloc_test() {
+    printf("Begin Realloc Test\n");
+
+    unsigned char* a = realloc(NULL, 10);
+    assert(a != NULL);
+    for (int i = 0; i < 10; i++)
+        a[i] = i;
+
+    for (size_t size = 20; size < 100000; size *= 2) {
+        a = realloc(a, size);
+        assert(a != NULL);
+        assert(malloc_usable_size(a) >= size);
+        for (int i = 0; i < 10; i++)
+            assert(a[i] == i);
+    }
+
+    a = realloc(a, 5);
+    for (int i = 0; i < 5; i++)
+        assert(a[i] == i);
+
+    assert(realloc(a, 0) == NULL);
+}
+
+void aligned_test() {
+    printf("Begin Aligned Test\n");
+
+    size_t alignments[] = {16, 32, 64, 256, 4096};
+    for (int i = 0; i < sizeof(alignments) / sizeof(size_t); i++) {
+        size_t alignment = alignments[i];
+
+        void* a;
+        assert(posix_memalign(&a, alignment, 100) == 0);
+        assert((uintptr_t)a % alignment == 0);
+        assert(malloc_usable_size(a) >= 100);
+        memset(a, 1, 100);
+
+        void* b = aligned_alloc(alignment, 3 * alignment);
+        assert((uintptr_t)b % alignment == 0);
+        assert(malloc_usable_size(b) >= 3 * alignment);
+
+        void* c = memalign(alignment, 1);
+        assert((uintptr_t)c % alignment == 0);
+
+        // Growing one keeps its contents, not its alignment
+        a = realloc(a, 10000);
+        assert(((unsigned char*)a)[99] == 1);
+
+        free(a);
+        free(b);
+        free(c);
+    }
+
+    void* a = NULL;
+    assert(posix_memalign(&a, 24, 100) == EINVAL);
+    assert(posix_memalign(&a, 4, 100) == EINVAL);
+    assert(a == NULL);
+
+    void* page = valloc(10);
+    assert((uintptr_t)page % getpagesize() == 0);
+    free(page);
+}
+
+void* churn(void* arg) {
+    unsigned int seed = (uintptr_t)arg;
+    unsigned char* blocks[SLOTS] = {0};
+    size_t sizes[SLOTS] = {0};
+
+    for (int i = 0; i < ITERATIONS || running; i++) {
+        int slot = rand_r(&seed) % SLOTS;
+
+        if (blocks[slot] != NULL) {
+            for (size_t j = 0; j < sizes[slot]; j++)
+                assert(blocks[slot][j] == (unsigned char)slot);
+
+            free(blocks[slot]);
+            blocks[slot] = NULL;
+            continue;
+        }
+
+        size_t size = rand_r(&seed) % 16 == 0 ? 600 + rand_r(&seed) % 4000
+                                              : 1 + rand_r(&seed) % 256;
+
+        unsigned char* block = rand_r(&seed) % 8 == 0 ? memalign(64, size)
+                                                      : malloc(size);
+        assert(block != NULL);
+        memset(block, slot, size);
+        blocks[slot] = block;
+        sizes[slot] = size;
+    }
+
+    for (int slot = 0; slot < SLOTS; slot++)
+        free(blocks[slot]);
+
+    return NULL;
+}
+
+void threads_test() {
+    printf("Begin Threads Test with %d Threads\n", THREADS);
+
+    pthread_t threads[THREADS];
+    for (uintptr_t i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, (void*)(i + 1));
+
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/*
+ * Forks while other threads are using the heap, the child has to be able to
+ * allocate and collect with them gone.
+ */
+void fork_test() {
+    printf("Begin Fork Test with %d Threads\n", THREADS);
+
+    running = true;
+
+    pthread_t threads[THREADS];
+    for (uintptr_t i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, (void*)(i + 1));
+
+    for (int i = 0; i < FORKS; i++) {
+        int* held = malloc(64 * sizeof(int));
+        held[63] = i;
+
+        pid_t child = fork();
+        assert(child != -1);
+
+        if (child == 0) {
+            for (int j = 0; j < 1000; j++)
+                free(malloc(j));
+
+            garbage_collect();
+            _exit(held[63] == i ? 0 : 1);
+        }
+
+        int status;
+        assert(waitpid(child, &status, 0) == child);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        free(held);
+    }
+
+    running = false;
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+}
+
+int main() {
+    basics_test();
+    realloc_test();
+    aligned_test();
+    threads_test();
+    fork_test();
+
+    printf("Preload Testing Successful\n");
+}
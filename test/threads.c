@@ -0,0 +1,206 @@
+#include "../alloc.h"
+#include "../gc.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS 8
+#define ITERATIONS 20000
+#define SLOTS 64
+#define NODES 1000
+#define COLLECTIONS 50
+
+extern Collector NARSIRABAD_COLLECTOR;
+
+typedef struct Node {
+    struct Node* next;
+    int value;
+} Node;
+
+volatile bool collecting;
+
+void print_pauses() {
+    printf("Pauses: %.3fms average, %.3fms max\n",
+           NARSIRABAD_COLLECTOR.total_pause / 1e6 / NARSIRABAD_COLLECTOR.pauses,
+           NARSIRABAD_COLLECTOR.max_pause / 1e6);
+}
+
+void* churn(void* arg) {
+    unsigned int seed = (uintptr_t)arg;
+    unsigned char* blocks[SLOTS] = {0};
+    int sizes[SLOTS] = {0};
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        int slot = rand_r(&seed) % SLOTS;
+
+        if (blocks[slot] != NULL) {
+            // Nobody else may have written into our block
+            for (int j = 0; j < sizes[slot]; j++)
+                assert(blocks[slot][j] == (unsigned char)slot);
+
+            deallocate(blocks[slot]);
+            blocks[slot] = NULL;
+            continue;
+        }
+
+        // Mostly small blocks that go through the thread caches, with the odd
+        // larger one that has to take the lock
+        int size = rand_r(&seed) % 16 == 0 ? 600 + rand_r(&seed) % 1400
+                                           : 1 + rand_r(&seed) % 256;
+
+        unsigned char* block = allocate(size);
+        assert(block != NULL);
+        for (int j = 0; j < size; j++)
+            assert(block[j] == 0);
+
+        memset(block, slot, size);
+        blocks[slot] = block;
+        sizes[slot] = size;
+    }
+
+    for (int slot = 0; slot < SLOTS; slot++)
+        deallocate(blocks[slot]);
+
+    return NULL;
+}
+
+void churn_test() {
+    printf("Begin Churn Test with %d Threads\n", THREADS);
+
+    pthread_t threads[THREADS];
+    for (uintptr_t i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, (void*)(i + 1));
+
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/*
+ * Builds a list only its own stack points to, and checks it survives every
+ * collection the main thread makes while it keeps allocating.
+ */
+void* hold_list(void* arg) {
+    Node* head = NULL;
+    for (int i = 0; i < NODES; i++) {
+        Node* node = allocate(sizeof(Node));
+        node->next = head;
+        node->value = i;
+        head = node;
+    }
+
+    while (collecting) {
+        int expected = NODES - 1;
+        for (Node* node = head; node != NULL; node = node->next)
+            assert(node->value == expected--);
+        assert(expected == -1);
+
+        // Garbage for the collector to find
+        allocate(sizeof(Node));
+    }
+
+    return NULL;
+}
+
+void stop_the_world_test() {
+    printf("Begin Stop the World Test with %d Threads\n", THREADS);
+
+    collecting = true;
+
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, hold_list, NULL);
+
+    uint64_t collections = NARSIRABAD_COLLECTOR.collections;
+    for (int i = 0; i < COLLECTIONS; i++)
+        garbage_collect();
+
+    collecting = false;
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    assert(NARSIRABAD_COLLECTOR.collections >= collections + COLLECTIONS);
+    print_pauses();
+}
+
+/*
+ * Keeps moving the nodes of a list only its own stack points to around, and
+ * replacing some of them, while incremental cycles run.
+ */
+void* shuffle_list(void* arg) {
+    unsigned int seed = (uintptr_t)arg;
+
+    Node* head = allocate(sizeof(Node));
+    for (int i = 1; i < NODES; i++) {
+        Node* node = allocate(sizeof(Node));
+        node->next = head->next;
+        node->value = i;
+        head->next = node;
+    }
+
+    while (collecting) {
+        // Move the node after the head further down the list
+        Node* node = head->next;
+        head->next = node->next;
+
+        Node* after = head;
+        for (int steps = rand_r(&seed) % NODES / 2; steps > 0; steps--)
+            after = after->next;
+
+        // And sometimes replace it, leaving the old one as garbage
+        if (rand_r(&seed) % 4 == 0) {
+            Node* copy = allocate(sizeof(Node));
+            copy->value = node->value;
+            node = copy;
+        }
+
+        node->next = after->next;
+        after->next = node;
+
+        int count = 0;
+        long sum = 0;
+        for (Node* node = head; node != NULL; node = node->next) {
+            count++;
+            sum += node->value;
+        }
+        assert(count == NODES);
+        assert(sum == (long)NODES * (NODES - 1) / 2);
+    }
+
+    return NULL;
+}
+
+void incremental_test() {
+    printf("Begin Incremental Test with %d Threads\n", THREADS);
+
+    gc_enable_incremental(4096, 0);
+    NARSIRABAD_COLLECTOR.pauses = 0;
+    NARSIRABAD_COLLECTOR.total_pause = 0;
+    NARSIRABAD_COLLECTOR.max_pause = 0;
+
+    collecting = true;
+
+    pthread_t threads[THREADS];
+    for (uintptr_t i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, shuffle_list, (void*)(i + 1));
+
+    // Garbage that runs the heap out, which is what starts a cycle
+    uint64_t collections = NARSIRABAD_COLLECTOR.collections;
+    while (NARSIRABAD_COLLECTOR.collections < collections + 5)
+        allocate(2048);
+
+    collecting = false;
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    print_pauses();
+}
+
+int main() {
+    churn_test();
+    stop_the_world_test();
+    incremental_test();
+
+    printf("\nThread Testing Successful\n");
+}